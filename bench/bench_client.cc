@@ -0,0 +1,359 @@
+// bench client, sweeps payload size, threads, calls in flight per
+// connection and connections against bench_server, and prints a JSON
+// report of throughput and latency percentiles for each point.
+//
+// closed loop: each connection keeps up to -o calls in flight and a new
+// call goes out as soon as one is done.
+// open loop: calls are due at a fixed rate whatever the server does, and
+// the latency of a call is taken from when it was due, not from when it
+// could be sent, so a stalled server shows up in the tail instead of
+// slowing the load down (no coordinated omission).
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench_protocol.h"
+#include "rpc/rpc_client.hpp"
+#include "histogram.h"
+
+#define BENCH_TIMEOUT_US (10 * 1000 * 1000)
+
+enum bench_mode { CLOSED, OPEN };
+
+struct bench_point {
+  bench_mode mode;
+  size_t size;  // request payload
+  size_t rep_size;  // reply payload
+  int threads;
+  int outstanding;  // calls in flight per connection at most
+  int conns;
+  double rate;  // calls/s over all threads, open loop only
+};
+
+// a connection and the calls in flight on it. its replies all come on
+// the polling thread of cl, which is the only one to touch hist
+struct bench_conn {
+  RPCC *cl;
+  pthread_mutex_t m;  // protect inflight
+  pthread_cond_t c;
+  int inflight;
+  histogram hist;
+  uint64_t last;  // usec the last recorded call was done
+  std::atomic<uint64_t> errors;
+
+  bench_conn(): cl(NULL), inflight(0), last(0), errors(0) {
+    VERIFY(pthread_mutex_init(&m, 0) == 0);
+    VERIFY(pthread_cond_init(&c, 0) == 0);
+  }
+
+  ~bench_conn() {
+    delete cl;
+    VERIFY(pthread_mutex_destroy(&m) == 0);
+    VERIFY(pthread_cond_destroy(&c) == 0);
+  }
+
+  // wait for a free slot of n
+  void acquire(int n) {
+    ScopedLock ml(&m);
+    while (inflight >= n)
+      VERIFY(pthread_cond_wait(&c, &m) == 0);
+    inflight++;
+  }
+
+  void release() {
+    ScopedLock ml(&m);
+    inflight--;
+    VERIFY(pthread_cond_broadcast(&c) == 0);
+  }
+
+  void drain() {
+    ScopedLock ml(&m);
+    while (inflight > 0)
+      VERIFY(pthread_cond_wait(&c, &m) == 0);
+  }
+};
+
+struct bench_run {
+  const bench_point *pt;
+  std::string payload;
+  std::vector<bench_conn *> conns;
+  uint64_t start;  // usec at which the warmup starts
+  uint64_t measure;  // usec from which calls are recorded
+  uint64_t end;  // usec at which no more calls are issued
+};
+
+struct bench_thread {
+  bench_run *run;
+  bench_conn *conn;
+  int idx;
+  pthread_t th;
+};
+
+static void sleep_until(uint64_t us)
+{
+  struct timespec ts;
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+// issue a call counted from start, the slot of it is taken already
+static void issue(bench_run *run, bench_conn *bc, uint64_t start)
+{
+  bool measured = start >= run->measure;
+  int ret = bc->cl->call_async_us<std::string>(bench_protocol::echo,
+      [run, bc, start, measured](int ret, std::string &r) {
+    if (measured) {
+      if (ret < 0 || r.size() != run->pt->rep_size)
+        bc->errors++;
+      else {
+        bc->last = timer::get_usec();
+        bc->hist.record(bc->last - start);
+      }
+    }
+    bc->release();
+  }, BENCH_TIMEOUT_US, std::string_view(run->payload), (unsigned int)run->pt->rep_size);
+  if (ret < 0) {
+    if (measured) bc->errors++;
+    bc->release();
+  }
+}
+
+static void *closed_loop(void *arg)
+{
+  bench_thread *t = (bench_thread *)arg;
+  bench_run *run = t->run;
+  while (1) {
+    t->conn->acquire(run->pt->outstanding);
+    uint64_t now = timer::get_usec();
+    if (now >= run->end) {
+      t->conn->release();
+      break;
+    }
+    issue(run, t->conn, now);
+  }
+  return 0;
+}
+
+static void *open_loop(void *arg)
+{
+  bench_thread *t = (bench_thread *)arg;
+  bench_run *run = t->run;
+  // threads take turns on one schedule, so the rate is the same at any thread count
+  double interval = 1e6 / run->pt->rate;
+  for (uint64_t k = t->idx;; k += run->pt->threads) {
+    uint64_t due = run->start + (uint64_t)(k * interval);
+    if (due >= run->end) break;
+    if (due > timer::get_usec()) sleep_until(due);
+    // a late call keeps its due time, the wait for it is latency too
+    t->conn->acquire(run->pt->outstanding);
+    issue(run, t->conn, due);
+  }
+  return 0;
+}
+
+static bool run_point(const char *host, int port, const bench_point &pt,
+    double warmup, double duration, FILE *out, bool first)
+{
+  bench_run run;
+  run.pt = &pt;
+  run.payload.assign(pt.size, 'b');
+  for (int i = 0; i < pt.conns; i++) {
+    bench_conn *bc = new bench_conn();
+    run.conns.push_back(bc);
+    bc->cl = new RPCC(host, port);
+    if (bc->cl->bind() < 0) {
+      fprintf(stderr, "bench_client: bind failure\n");
+      for (auto &&c : run.conns) delete c;
+      return false;
+    }
+  }
+
+  run.start = timer::get_usec();
+  run.measure = run.start + (uint64_t)(warmup * 1e6);
+  run.end = run.measure + (uint64_t)(duration * 1e6);
+  std::vector<bench_thread> ths(pt.threads);
+  for (int i = 0; i < pt.threads; i++) {
+    ths[i].run = &run;
+    ths[i].conn = run.conns[i % pt.conns];
+    ths[i].idx = i;
+    VERIFY(pthread_create(&ths[i].th, NULL,
+        pt.mode == CLOSED ? closed_loop : open_loop, &ths[i]) == 0);
+  }
+  for (auto &&t : ths)
+    VERIFY(pthread_join(t.th, NULL) == 0);
+
+  histogram h;
+  uint64_t errors = 0, last = run.end;
+  for (auto &&bc : run.conns) {
+    bc->drain();
+    h.add(bc->hist);
+    errors += bc->errors;
+    if (bc->last > last) last = bc->last;
+  }
+  for (auto &&bc : run.conns) delete bc;
+
+  // an open loop the server cannot keep up with finishes late, the
+  // throughput is what was done, not what was asked for
+  double elapsed = (last - run.measure) / 1e6;
+  double tput = h.count() / elapsed;
+  fprintf(out, "%s\n    {\"mode\": \"%s\", \"size\": %zu, \"reply_size\": %zu, "
+      "\"threads\": %d, \"outstanding\": %d, \"conns\": %d, \"rate\": %.0f, "
+      "\"duration_s\": %.3f, \"calls\": %lu, \"errors\": %lu, "
+      "\"calls_per_s\": %.1f, \"mb_per_s\": %.2f, "
+      "\"latency_us\": {\"min\": %lu, \"mean\": %.1f, \"p50\": %lu, "
+      "\"p99\": %lu, \"p99.9\": %lu, \"max\": %lu}}",
+      first ? "" : ",", pt.mode == CLOSED ? "closed" : "open", pt.size, pt.rep_size,
+      pt.threads, pt.outstanding, pt.conns, pt.mode == OPEN ? pt.rate : 0.0,
+      elapsed, h.count(), errors, tput, tput * (pt.size + pt.rep_size) / 1e6,
+      h.min(), h.mean(), h.percentile(50), h.percentile(99), h.percentile(99.9), h.max());
+  fflush(out);
+  fprintf(stderr, "%s size %zu threads %d outstanding %d conns %d rate %.0f: "
+      "%.0f calls/s p50 %lu p99 %lu p99.9 %lu max %lu us, %lu errors\n",
+      pt.mode == CLOSED ? "closed" : "open", pt.size, pt.threads, pt.outstanding,
+      pt.conns, pt.mode == OPEN ? pt.rate : 0.0, tput, h.percentile(50),
+      h.percentile(99), h.percentile(99.9), h.max(), errors);
+  return true;
+}
+
+// a number with an optional k or m suffix (x1024 / x1048576)
+static bool parse_num(const char *s, double *v)
+{
+  char *end;
+  errno = 0;
+  *v = strtod(s, &end);
+  if (errno || end == s || *v < 0) return false;
+  if (*end == 'k' || *end == 'K') {*v *= 1024; end++;}
+  else if (*end == 'm' || *end == 'M') {*v *= 1024 * 1024; end++;}
+  return *end == '\0';
+}
+
+// a comma separated list of numbers
+static bool parse_list(const char *s, std::vector<double> *vs)
+{
+  vs->clear();
+  std::string str(s);
+  size_t pos = 0;
+  while (pos <= str.size()) {
+    size_t comma = str.find(',', pos);
+    if (comma == std::string::npos) comma = str.size();
+    double v;
+    if (!parse_num(str.substr(pos, comma - pos).c_str(), &v)) return false;
+    vs->push_back(v);
+    pos = comma + 1;
+  }
+  return !vs->empty();
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [options] [host:]port\n"
+    "  -m modes        closed,open (closed)\n"
+    "  -s sizes        request payloads in bytes, k/m suffixes (64,4k,64k,1m)\n"
+    "  -r size         reply payload, same as the request if not given\n"
+    "  -t threads      client threads (1,4)\n"
+    "  -o outstanding  calls in flight per connection (1,16)\n"
+    "  -c conns        connections, threads are spread over them (1,4)\n"
+    "  -R rates        calls/s of the open loop (10000,50000)\n"
+    "  -d secs         measured time of each point (2)\n"
+    "  -w secs         warmup of each point, not measured (0.5)\n"
+    "  -l label        kept in the report, e.g. a commit id\n"
+    "  -f file         write the JSON report to file instead of stdout\n",
+    prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<double> sizes = {64, 4096, 65536, 1 << 20};
+  std::vector<double> threads = {1, 4}, outstanding = {1, 16}, conns = {1, 4};
+  std::vector<double> rates = {10000, 50000};
+  bool closed = true, open = false;
+  double rep_size = -1, duration = 2, warmup = 0.5;
+  const char *label = "", *file = NULL;
+
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:s:r:t:o:c:R:d:w:l:f:")) != -1) {
+    bool ok = true;
+    switch (opt) {
+    case 'm':
+      closed = strstr(optarg, "closed") != NULL;
+      open = strstr(optarg, "open") != NULL;
+      ok = closed || open;
+      break;
+    case 's': ok = parse_list(optarg, &sizes); break;
+    case 'r': ok = parse_num(optarg, &rep_size); break;
+    case 't': ok = parse_list(optarg, &threads); break;
+    case 'o': ok = parse_list(optarg, &outstanding); break;
+    case 'c': ok = parse_list(optarg, &conns); break;
+    case 'R': ok = parse_list(optarg, &rates); break;
+    case 'd': ok = parse_num(optarg, &duration) && duration > 0; break;
+    case 'w': ok = parse_num(optarg, &warmup); break;
+    case 'l': label = optarg; break;
+    case 'f': file = optarg; break;
+    default: ok = false;
+    }
+    if (!ok) usage(argv[0]);
+  }
+  if (optind != argc - 1) usage(argv[0]);
+
+  std::string host = "127.0.0.1";
+  std::string addr = argv[optind];
+  size_t colon = addr.rfind(':');
+  if (colon != std::string::npos) {
+    host = addr.substr(0, colon);
+    addr = addr.substr(colon + 1);
+  }
+  int port = atoi(addr.c_str());
+
+  FILE *out = stdout;
+  if (file && (out = fopen(file, "w")) == NULL) {
+    fprintf(stderr, "bench_client: cannot open %s: %s\n", file, strerror(errno));
+    exit(1);
+  }
+
+  fprintf(out, "{\"label\": \"%s\", \"server\": \"%s:%d\", \"runs\": [", label, host.c_str(), port);
+  bool first = true;
+  for (int m = CLOSED; m <= OPEN; m++) {
+    if ((m == CLOSED && !closed) || (m == OPEN && !open)) continue;
+    // the rate is an axis of the open loop only
+    std::vector<double> rs = m == OPEN ? rates : std::vector<double>{0};
+    for (double s : sizes)
+    for (double t : threads)
+    for (double o : outstanding)
+    for (double c : conns)
+    for (double r : rs) {
+      bench_point pt;
+      pt.mode = (bench_mode)m;
+      pt.size = (size_t)s;
+      pt.rep_size = rep_size < 0 ? pt.size : (size_t)rep_size;
+      pt.threads = t < 1 ? 1 : (int)t;
+      pt.outstanding = o < 1 ? 1 : (int)o;
+      pt.conns = c < 1 ? 1 : (int)c;
+      if (pt.conns > pt.threads) continue;  // a connection has a thread at least
+      pt.rate = r;
+      if (pt.size + pt.rep_size + 64 > MAX_MSG_SZ) {
+        fprintf(stderr, "bench_client: skip size %zu, over MAX_MSG_SZ\n", pt.size);
+        continue;
+      }
+      if (!run_point(host.c_str(), port, pt, warmup, duration, out, first)) exit(1);
+      first = false;
+    }
+  }
+  fprintf(out, "\n]}\n");
+  if (out != stdout) fclose(out);
+  return 0;
+}
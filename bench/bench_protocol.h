@@ -0,0 +1,12 @@
+// bench protocol
+#pragma once
+
+#include "rpc/rpc_server.hpp"
+#include "utils/timer.h"
+
+class bench_protocol {
+ public:
+  enum rpc_numbers {
+    echo = 0x7101,	// (string_view req, unsigned rep_sz) -> string of rep_sz bytes
+  };
+};
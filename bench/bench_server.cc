@@ -0,0 +1,40 @@
+// bench server, answers bench_protocol::echo as fast as it can
+
+#include <string>
+#include <string_view>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench_protocol.h"
+
+int main(int argc, char const *argv[])
+{
+  int loops = 1;
+  int workers = 0;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s port\n", argv[0]);
+    exit(1);
+  }
+
+  char *loops_env = getenv("RPC_LOOPS");
+  if (loops_env != NULL)
+    loops = atoi(loops_env);
+
+  char *workers_env = getenv("RPC_WORKERS");
+  if (workers_env != NULL)
+    workers = atoi(workers_env);
+
+  RPCS server(atoi(argv[1]), 0, loops, workers);
+  server.reg(bench_protocol::echo, [](std::string_view req, unsigned int rep_sz, std::string &r) {
+    // the reply is built from the request, as a real handler's would be
+    r.assign(rep_sz, req.empty() ? 'x' : req[0]);
+    return 0;
+  });
+  // start() runs the first loop in this thread and does not come back
+  printf("bench_server: port %s, %d loops, %d workers\n", argv[1], loops, workers);
+  server.start();
+}
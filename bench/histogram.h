@@ -0,0 +1,85 @@
+#pragma once
+// latency histogram in the HDR layout: values below 1 << HIST_SUB_BITS
+// get a bucket each, above that every power of 2 is split into
+// 1 << (HIST_SUB_BITS - 1) buckets, so a value is kept within 1/128 of
+// itself at a fixed size. recording is a shift and an increment, and
+// histograms of threads add up.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 8
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_MAX_BITS 40	// values from 1 << 40 on go in the last bucket
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_HALF)
+
+class histogram {
+	uint64_t counts_[HIST_BUCKETS];
+	uint64_t total_;
+	uint64_t min_, max_;
+	double sum_;
+
+	static size_t index_of(uint64_t v) {
+		if (v >> HIST_MAX_BITS) return HIST_BUCKETS - 1;
+		if (v < (1 << HIST_SUB_BITS)) return v;
+		int e = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+		return (size_t)e * HIST_HALF + (v >> e);
+	}
+
+	// the highest value that goes in bucket i
+	static uint64_t value_of(size_t i) {
+		if (i < (1 << HIST_SUB_BITS)) return i;
+		int e = i / HIST_HALF - 1;
+		return ((uint64_t)(i - (size_t)e * HIST_HALF) << e) + ((uint64_t)1 << e) - 1;
+	}
+
+public:
+	histogram() { reset(); }
+
+	void reset() {
+		memset(counts_, 0, sizeof(counts_));
+		total_ = 0;
+		min_ = UINT64_MAX;
+		max_ = 0;
+		sum_ = 0;
+	}
+
+	void record(uint64_t v) {
+		counts_[index_of(v)]++;
+		total_++;
+		if (v < min_) min_ = v;
+		if (v > max_) max_ = v;
+		sum_ += v;
+	}
+
+	void add(const histogram &h) {
+		for (size_t i = 0; i < HIST_BUCKETS; i++) counts_[i] += h.counts_[i];
+		total_ += h.total_;
+		if (h.min_ < min_) min_ = h.min_;
+		if (h.max_ > max_) max_ = h.max_;
+		sum_ += h.sum_;
+	}
+
+	uint64_t count() const { return total_; }
+	uint64_t min() const { return total_ ? min_ : 0; }
+	uint64_t max() const { return max_; }
+	double mean() const { return total_ ? sum_ / total_ : 0; }
+
+	// the value at or below which p percent of the values are
+	uint64_t percentile(double p) const {
+		if (!total_) return 0;
+		uint64_t rank = (uint64_t)(p / 100 * total_ + 0.5);
+		if (rank < 1) rank = 1;
+		if (rank >= total_) return max_;
+		uint64_t seen = 0;
+		for (size_t i = 0; i < HIST_BUCKETS; i++) {
+			seen += counts_[i];
+			if (seen >= rank) {
+				uint64_t v = value_of(i);
+				return v < max_ ? v : max_;
+			}
+		}
+		return max_;
+	}
+};
@@ -0,0 +1,17 @@
+# build the bench drivers, run bench_server on a port and sweep it with
+# bench_client, the report goes to build/bench-<commit>.json.
+# bench_client options are passed on, e.g.
+#   bench/run.sh -m closed,open -s 64,1m -t 1,8
+# RPC_LOOPS / RPC_WORKERS set up the server as for demo_server
+
+PORT=${BENCH_PORT:-19371}
+REV=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+make bench || exit 1
+
+./build/bench_server $PORT > /dev/null &
+SERVER=$!
+trap "kill $SERVER" EXIT
+sleep 1
+
+./build/bench_client -l "$REV" -f build/bench-$REV.json "$@" $PORT && echo "report in build/bench-$REV.json"
@@ -8,6 +8,7 @@ class demo_protocol {
   typedef int status;
   typedef unsigned long long demoVar;
   typedef std::string demoString;
+  typedef std::string_view demoStringView;  // same wire format, no copy on server
   enum rpc_numbers {
     stat = 0x7001,
     pass_string,
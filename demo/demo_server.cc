@@ -15,7 +15,7 @@ class demo_server {
   demo_server() {};
   ~demo_server() {};
   demo_protocol::status stat(int clt, demo_protocol::demoVar a, int &);
-  demo_protocol::status process_string(int clt, demo_protocol::demoVar start, demo_protocol::demoString str, demo_protocol::demoString &);
+  demo_protocol::status process_string(int clt, demo_protocol::demoVar start, demo_protocol::demoStringView str, demo_protocol::demoString &);
   // for illustration only
       // demo_protocol::status rpcA(int clt, demo_protocol::demoVar a, int &);
       // demo_protocol::status rpcB(int clt, demo_protocol::demoVar a, int &);
@@ -32,7 +32,7 @@ demo_server::stat(int clt, demo_protocol::demoVar var, int &r)
 }
 
 demo_protocol::status
-demo_server::process_string(int clt, demo_protocol::demoVar start, demo_protocol::demoString var, demo_protocol::demoString &r)
+demo_server::process_string(int clt, demo_protocol::demoVar start, demo_protocol::demoStringView var, demo_protocol::demoString &r)
 // demo_server::process_string(demo_protocol::demoString &r, int clt, demo_protocol::demoVar start, demo_protocol::demoString var)
 {
   printf("[Server] receive \"process_string\" request from clt %d.\n", clt);
@@ -46,6 +46,8 @@ demo_server::process_string(int clt, demo_protocol::demoVar start, demo_protocol
 int main(int argc, char const *argv[])
 {
     int count = 0;
+    int loops = 1;
+    int workers = 0;
 
     setvbuf(stdout, NULL, _IONBF, 0);
     setvbuf(stderr, NULL, _IONBF, 0);
@@ -62,8 +64,18 @@ int main(int argc, char const *argv[])
       count = atoi(count_env);
     }
 
+    char *loops_env = getenv("RPC_LOOPS");
+    if(loops_env != NULL){
+      loops = atoi(loops_env);
+    }
+
+    char *workers_env = getenv("RPC_WORKERS");
+    if(workers_env != NULL){
+      workers = atoi(workers_env);
+    }
+
     demo_server ds;  
-    RPCS server(atoi(argv[1]), count);
+    RPCS server(atoi(argv[1]), count, loops, workers);
     server.reg(demo_protocol::stat, &ds, &demo_server::stat);
     server.reg(demo_protocol::pass_string, &ds, &demo_server::process_string);
 
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "utils/verify.h"
+#include "utils/slock.h"
+
+#define BUF_MIN_SHIFT 6				// smallest class holds 64 bytes
+#define BUF_MAX_SHIFT 24			// largest class holds 16M, larger buffers bypass the pool
+#define BUF_NCLASS (BUF_MAX_SHIFT - BUF_MIN_SHIFT + 1)
+#define BUF_HUGE_SHIFT 21			// classes from 2M up are backed by hugepages
+#define BUF_CACHE_BYTES (1 << 20)	// per-thread cache of each class
+#define BUF_SHARED_BYTES (32 << 20)	// shared free list of each class
+
+// size-classed pool of msg buffers.
+// each thread keeps a small cache per class over a locked shared free list,
+// so a buffer allocated on one thread (e.g. a worker) and freed on another
+// (e.g. the loop after sending) flows back through the shared list.
+// every buffer has a header in front of it, so it can be freed without its size
+class BufPool {
+	struct hdr {
+		uint32_t cls;		// size class, BUF_NCLASS if outside the pool
+		uint32_t magic;
+		uint64_t capa;		// usable bytes after the header
+	};
+	static const uint32_t MAGIC = 0xb0f0b0f0;
+
+	struct shared_list {
+		pthread_mutex_t m;
+		std::vector<char *> bufs;
+	};
+	shared_list lists_[BUF_NCLASS];
+
+	// hands cached buffers back when its thread exits
+	struct local_cache {
+		std::vector<char *> bufs[BUF_NCLASS];
+		~local_cache() {
+			for (int i = 0; i < BUF_NCLASS; i++)
+				BufPool::get()->put_shared(i, bufs[i], bufs[i].size());
+			exited() = true;
+		}
+	};
+
+	static local_cache &local() {
+		thread_local local_cache c;
+		return c;
+	}
+
+	// set once the cache of this thread is gone, e.g. while statics are destroyed
+	static bool &exited() {
+		thread_local bool e = false;
+		return e;
+	}
+
+	static size_t class_sz(int cls) { return (size_t)1 << (cls + BUF_MIN_SHIFT); }
+
+	static bool huge(int cls) { return cls >= BUF_HUGE_SHIFT - BUF_MIN_SHIFT && cls < BUF_NCLASS; }
+
+	// usable bytes of a class. a hugepage class gives up room for the header,
+	// so header and buffer fill its pages and end on a page boundary
+	static size_t class_capa(int cls) { return class_sz(cls) - (huge(cls) ? sizeof(hdr) : 0); }
+
+	static size_t local_max(int cls) {
+		size_t n = BUF_CACHE_BYTES / class_sz(cls);
+		return n < 1 ? 1 : (n > 64 ? 64 : n);
+	}
+
+	static size_t shared_max(int cls) {
+		size_t n = BUF_SHARED_BYTES / class_sz(cls);
+		return n < 2 ? 2 : n;
+	}
+
+	static int class_of(size_t sz) {
+		if (sz > class_capa(BUF_NCLASS - 1)) return BUF_NCLASS;
+		int cls = 0;
+		while (class_capa(cls) < sz) cls++;
+		return cls;
+	}
+
+	static char *sys_alloc(int cls, size_t capa) {
+		size_t sz = sizeof(hdr) + capa;
+		void *p = NULL;
+		if (huge(cls)) {
+			VERIFY(posix_memalign(&p, (size_t)1 << BUF_HUGE_SHIFT, sz) == 0);
+#ifdef MADV_HUGEPAGE
+			// best effort, a kernel without THP just keeps normal pages
+			size_t page = sysconf(_SC_PAGESIZE);
+			madvise(p, (sz + page - 1) & ~(page - 1), MADV_HUGEPAGE);
+#endif
+		} else {
+			p = malloc(sz);
+			VERIFY(p);
+		}
+		hdr *h = (hdr *)p;
+		h->cls = cls;
+		h->magic = MAGIC;
+		h->capa = capa;
+		return (char *)(h + 1);
+	}
+
+	static hdr *hdr_of(char *p) {
+		hdr *h = (hdr *)p - 1;
+		VERIFY(h->magic == MAGIC);
+		return h;
+	}
+
+	// move the last n buffers of bufs to the shared list, beyond its bound they are freed
+	void put_shared(int cls, std::vector<char *> &bufs, size_t n) {
+		size_t keep = bufs.size() - n;
+		{
+			ScopedLock ml(&lists_[cls].m);
+			std::vector<char *> &l = lists_[cls].bufs;
+			while (bufs.size() > keep && l.size() < shared_max(cls)) {
+				l.push_back(bufs.back());
+				bufs.pop_back();
+			}
+		}
+		while (bufs.size() > keep) {
+			::free(hdr_of(bufs.back()));
+			bufs.pop_back();
+		}
+	}
+
+	// move up to half a cache of buffers from the shared list to bufs
+	void get_shared(int cls, std::vector<char *> &bufs) {
+		ScopedLock ml(&lists_[cls].m);
+		std::vector<char *> &l = lists_[cls].bufs;
+		size_t n = local_max(cls) / 2 + 1;
+		while (n-- > 0 && !l.empty()) {
+			bufs.push_back(l.back());
+			l.pop_back();
+		}
+	}
+
+	BufPool() {
+		for (int i = 0; i < BUF_NCLASS; i++)
+			VERIFY(pthread_mutex_init(&lists_[i].m, 0) == 0);
+	}
+
+public:
+	// never destroyed, threads may still free buffers while statics go away
+	static BufPool *get() {
+		static BufPool *pool = new BufPool();
+		return pool;
+	}
+
+	// buffer of at least sz bytes
+	char *alloc(size_t sz) {
+		int cls = class_of(sz);
+		if (cls == BUF_NCLASS) return sys_alloc(cls, sz);
+
+		if (exited()) return sys_alloc(cls, class_capa(cls));
+		std::vector<char *> &c = local().bufs[cls];
+		if (c.empty()) get_shared(cls, c);
+		if (c.empty()) return sys_alloc(cls, class_capa(cls));
+		char *p = c.back();
+		c.pop_back();
+		return p;
+	}
+
+	void free(char *p) {
+		if (!p) return;
+		hdr *h = hdr_of(p);
+		if (h->cls == BUF_NCLASS) {
+			::free(h);
+			return;
+		}
+
+		if (exited()) {
+			std::vector<char *> one(1, p);
+			put_shared(h->cls, one, 1);
+			return;
+		}
+		std::vector<char *> &c = local().bufs[h->cls];
+		if (c.size() >= local_max(h->cls)) put_shared(h->cls, c, c.size() / 2 + 1);
+		c.push_back(p);
+	}
+
+	// usable bytes of p, at least what it was allocated with
+	static size_t capa(char *p) { return hdr_of(p)->capa; }
+};
+
+inline char *buf_alloc(size_t sz) { return BufPool::get()->alloc(sz); }
+inline void buf_free(char *p) { BufPool::get()->free(p); }
+inline size_t buf_capa(char *p) { return BufPool::capa(p); }
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+
+#include "utils/verify.h"
+#include "utils/slock.h"
+
+#define CALL_TABLE_SZ (1 << 14)		// slots in a call table, must be a power of 2
+
+// pending calls indexed by rid modulo the capacity, no global lock.
+// each slot is tagged with the rid it holds, so a stale rid never matches
+// a newer call. a call whose slot is still held by an older one goes to
+// a locked overflow map, which is only searched while it is non-empty.
+template <class T>
+class call_table {
+	static const uint64_t EMPTY = 0;
+	static const uint64_t BUSY = UINT64_MAX;	// slot being filled or emptied
+
+	struct slot {
+		std::atomic<uint64_t> tag;	// rid + 1, EMPTY or BUSY
+		T *val;
+	};
+
+	slot *slots_;
+	size_t mask_;
+
+	pthread_mutex_t m_;		// protect overflow_
+	std::map<unsigned int, T *> overflow_;
+	std::atomic<size_t> noverflow_;
+
+	static uint64_t tag_of(unsigned int rid) { return (uint64_t)rid + 1; }
+
+public:
+	call_table(size_t sz = CALL_TABLE_SZ): mask_(sz - 1), noverflow_(0) {
+		VERIFY(sz && (sz & (sz - 1)) == 0);
+		slots_ = new slot[sz]();
+		VERIFY(pthread_mutex_init(&m_, 0) == 0);
+	}
+
+	~call_table() {
+		delete[] slots_;
+		VERIFY(pthread_mutex_destroy(&m_) == 0);
+	}
+
+	// register v as the pending call of rid
+	void insert(unsigned int rid, T *v) {
+		slot &s = slots_[rid & mask_];
+		uint64_t expected = EMPTY;
+		if (s.tag.compare_exchange_strong(expected, BUSY, std::memory_order_acquire)) {
+			s.val = v;
+			s.tag.store(tag_of(rid), std::memory_order_release);
+			return;
+		}
+
+		// slot held by an older call
+		ScopedLock ml(&m_);
+		overflow_[rid] = v;
+		noverflow_++;
+	}
+
+	// remove and return the pending call of rid, NULL if there is none.
+	// only one of concurrent takes of the same rid gets the call
+	T *take(unsigned int rid) {
+		slot &s = slots_[rid & mask_];
+		uint64_t expected = tag_of(rid);
+		if (s.tag.compare_exchange_strong(expected, BUSY, std::memory_order_acquire)) {
+			T *v = s.val;
+			s.tag.store(EMPTY, std::memory_order_release);
+			return v;
+		}
+
+		if (noverflow_ == 0) return NULL;
+		ScopedLock ml(&m_);
+		auto res = overflow_.find(rid);
+		if (res == overflow_.end()) return NULL;
+		T *v = res->second;
+		overflow_.erase(res);
+		noverflow_--;
+		return v;
+	}
+
+	// remove all pending calls, f(v) is called on each.
+	// must not race with insert or take
+	template <class F>
+	void drain(F f) {
+		for (size_t i = 0; i <= mask_; i++) {
+			uint64_t tag = slots_[i].tag.load();
+			if (tag == EMPTY) continue;
+			VERIFY(tag != BUSY);
+			slots_[i].tag.store(EMPTY);
+			f(slots_[i].val);
+		}
+		ScopedLock ml(&m_);
+		for (auto &&call : overflow_) f(call.second);
+		overflow_.clear();
+		noverflow_ = 0;
+	}
+};
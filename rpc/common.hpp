@@ -4,18 +4,17 @@
 
 typedef int TO;		// timeout
 
-class handler {
-	public:
-		handler() { }
-		virtual ~handler() { }
-		virtual int fn(unmarshall &, marshall &) = 0;
-};
-
 // consts for rpc
 class rpc_const {
 	public:
 		// handler number reserved for bind
 		static const unsigned int bind = 1;
+		// handler number reserved for batches of calls
+		static const unsigned int batch = 2;
+		// handler number reserved for frames of streams
+		static const unsigned int stream = 3;
+		// handler number reserved for cancel frames, which get no reply
+		static const unsigned int cancel = 4;
 
 		// error numbers
 		static const int timeout_failure = -1;
@@ -26,6 +25,8 @@ class rpc_const {
 		static const int bind_failure = -6;
 		static const int cancel_failure = -7;
 		static const int unknown_proc = -8;
+		static const int stream_failure = -9;
+		static const int deadline_failure = -10;
 
 		// timeout limits
 		static const int to_max = 120000;
@@ -5,27 +5,53 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
 #include <queue>
+#include <deque>
+#include <atomic>
+#include <algorithm>
 
 #include "utils/verify.h"
 #include "utils/slock.h"
+#include "utils/crc32c.h"
+#include "utils/lz.h"
+#include "bufpool.hpp"
+#include "marshall.hpp"
 
 #define MAX_MSG_SZ (10 << 20)    	// maximum MSG size is 10M
-#define MAX_MSG_CNT 10				// maximum MSG number in a single read_cb/write_cb
+#define MAX_MSG_CNT 10				// maximum MSG number in a single read_cb
+#define MAX_IOV_CNT 64				// maximum MSG number gathered in a single sendmsg
+#define RSLAB_SZ (64 << 10)			// per-connection receive slab, larger MSGs get their own buffer
+#define ZEROCOPY_MIN_SZ (64 << 10)	// default smallest MSG sent with MSG_ZEROCOPY once enabled
+#define COMPRESS_MIN_SZ (1 << 10)	// default smallest MSG compressed once negotiated
+
+// flags in the top bits of the size prefix, clear on a plain MSG
+#define MSG_CRC_FLAG 0x80000000u	// ends with a CRC32C trailer
+#define MSG_LZ_FLAG 0x40000000u		// the rest is a raw size and an lz block
+#define MSG_LZ_OK 0x20000000u		// the sender takes compressed MSGs
+#define MSG_FLAGS (MSG_CRC_FLAG | MSG_LZ_FLAG | MSG_LZ_OK)
 
 // one buffer obj for each msg
 struct buffer {
 	char *buf;
 	int sz;
 	int solong; //amount of bytes written or read so far
+	rpc_file file;	// blob sent after buf, see rpc_file, only for writes
+	size_t fsent;	// bytes of the blob sent so far
+	uint32_t flags;	// MSG_* flags of its size prefix, only for writes
+	bool prepared;	// compressed and sealed as needed, see Connection::prepare
 
-	buffer(): buf(NULL), sz(0), solong(0) {}
-	buffer (char *b, int s) : buf(b), sz(s), solong(0){}
+	buffer(): buf(NULL), sz(0), solong(0), fsent(0), flags(0), prepared(false) {}
+	buffer (char *b, int s) : buf(b), sz(s), solong(0), fsent(0), flags(0), prepared(false) {}
 	~buffer() {}
 
 	// if the buffer is empty
@@ -43,11 +69,16 @@ struct buffer {
     void reset() {
 		buf = NULL;
 		sz = solong = 0;
+		file = rpc_file();
+		fsent = 0;
+		flags = 0;
+		prepared = false;
     }
 
-	// only called when connection is over
+	// free the buffer and close the blob
 	void clear() {
-        if (buf) free(buf);
+        if (buf) buf_free(buf);
+		if (file.fd >= 0) close(file.fd);
 		reset();
 	}
 };
@@ -55,117 +86,418 @@ struct buffer {
 // one connection obj for one socket connection
 class Connection {
 	int fd_;
-	bool dead_;
-	buffer wbuf;    // curr write msg buffer
-	buffer rbuf;    // curr read msg buffer
-	std::queue<buffer> wbufq;    // write msg buffer queue
+	std::atomic<bool> dead_;
+	std::atomic<int> refno_;	// references held by loops and in-flight jobs
+	buffer rbuf;    // curr read msg too large for rslab
+	char *rslab;    // receive slab, only held while a conn is busy
+	int rslab_len;  // bytes in rslab, a partial msg is kept at its front
+	std::deque<buffer> wbufq;    // write msg buffer queue, front may be partly written
 	std::queue<buffer> rbufq;    // read msg buffer queue
 	pthread_mutex_t m_; 		// protect channel
-	pthread_mutex_t wm_; 		// protect wbuf and wbufq
-	pthread_mutex_t rm_; 		// protect rbuf and rbufq
-
-	// read msg to rbuffer, may not complete a msg
-    bool read_msg() {
-		// printf("---Connection::read_msg---\n");
-		// allocate new buffer for new message
-		if (!rbuf.sz) {
-			uint32_t sz, sz_raw;
-			int n = read(fd_, &sz_raw, sizeof(sz_raw));
+	pthread_mutex_t wm_; 		// protect wbufq
+	pthread_mutex_t rm_; 		// protect rbuf, rslab and rbufq
+	std::atomic<bool> crc_;		// seal outgoing msgs, turned on by checksum or by the peer sending one
+	std::atomic<bool> crc_in_;	// the peer has sent a sealed msg
+	std::atomic<size_t> lz_min_;	// compress msgs of at least this size if the peer takes them, 0 if off
+	std::atomic<bool> lz_peer_;	// the peer takes compressed msgs
+	static inline std::atomic<uint64_t> bad_msgs_{0};	// msgs with a bad checksum or block, all conns
+
+	// MSG_ZEROCOPY state, protected by m_.
+	// the kernel numbers every zerocopy send of a socket from 0 and reports
+	// done ranges on the error queue, in order for tcp. a sent msg is held
+	// until the last send that covered it is done
+	size_t zc_min_;				// msgs of at least this size go zerocopy, 0 if off
+	uint32_t zc_next_;			// id of the next zerocopy send
+	uint32_t zc_done_;			// sends before this id are done
+	std::deque<std::pair<uint32_t, char *>> zc_held_;	// sent buffers by their last send id
+
+	// if msg b goes out with MSG_ZEROCOPY, decided on its whole size so
+	// a msg never mixes copied and zerocopy parts
+	bool zerocopy_msg(const buffer &b) {
+		return zc_min_ && (size_t)b.sz >= zc_min_ && b.file.fd < 0;
+	}
 
-			if (n == 0) return false;
-			if (n < 0) {
-				VERIFY(errno!=EAGAIN);
-				return false;
-			}
-			if (n > 0 && n!= sizeof(sz)) {
-				printf("Connection::read_msg(fd_ %d) short read of sz\n", fd_);
-				return false;
+	// read completions off the error queue and free the buffers they release
+	void reap_zerocopy() {
+		while (!zc_held_.empty()) {
+			char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_control = ctrl;
+			msg.msg_controllen = sizeof(ctrl);
+			if (recvmsg(fd_, &msg, MSG_ERRQUEUE) < 0) break;	// EAGAIN, nothing more yet
+
+			for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+				if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+						!(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+					continue;
+				struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+				if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+				// sends ee_info..ee_data are done
+				if ((int32_t)(ee->ee_data + 1 - zc_done_) > 0) zc_done_ = ee->ee_data + 1;
 			}
+		}
+		while (!zc_held_.empty() && (int32_t)(zc_done_ - zc_held_.front().first) > 0) {
+			buf_free(zc_held_.front().second);
+			zc_held_.pop_front();
+		}
+	}
+
+	// frame size on the wire of msg b
+	static uint32_t wire_sz(const buffer &b) {
+		return (b.sz + b.file.len) | b.flags;
+	}
+
+	// append a CRC32C of the whole frame, size prefix included.
+	// a msg with a blob goes out unsealed, the checksum would need its bytes
+	static void seal(buffer &b) {
+		if (b.flags & MSG_CRC_FLAG || b.file.fd >= 0) return;
+		if (buf_capa(b.buf) < (size_t)b.sz + 4) {
+			char *nb = buf_alloc(b.sz + 4);
+			memcpy(nb, b.buf, b.sz);
+			buf_free(b.buf);
+			b.buf = nb;
+		}
+		b.sz += 4;
+		b.flags |= MSG_CRC_FLAG;
+		uint32_t x = htonl(wire_sz(b));
+		memcpy(b.buf, &x, sizeof(x));
+		x = htonl(crc32c(0, b.buf, b.sz - 4));
+		memcpy(b.buf + b.sz - 4, &x, sizeof(x));
+	}
+
+	// replace what follows the size prefix by its raw size and lz block,
+	// the msg is kept as is unless that makes it smaller
+	static void compress(buffer &b) {
+		if (b.flags & (MSG_LZ_FLAG | MSG_CRC_FLAG) || b.file.fd >= 0 || b.sz <= 16) return;
+		size_t raw = b.sz - 4;
+		char *nb = buf_alloc(b.sz + 4);		// room for a trailer
+		size_t n = lz_compress(b.buf + 4, raw, nb + 8, raw - 5);
+		if (n == 0) {
+			buf_free(nb);
+			return;
+		}
+		uint32_t x = htonl(raw);
+		memcpy(nb + 4, &x, sizeof(x));
+		buf_free(b.buf);
+		b.buf = nb;
+		b.sz = 8 + n;
+		b.flags |= MSG_LZ_FLAG;
+	}
+
+	// restore a compressed msg, false if it is corrupt
+	bool decompress(buffer &b) {
+		uint32_t raw;
+		if (b.sz < 8) return false;
+		memcpy(&raw, b.buf + 4, sizeof(raw));
+		raw = ntohl(raw);
+		if (raw > MAX_MSG_SZ) return false;
+		char *nb = buf_alloc(raw + 4);
+		if (!lz_decompress(b.buf + 8, b.sz - 8, nb + 4, raw)) {
+			buf_free(nb);
+			return false;
+		}
+		uint32_t x = htonl(raw + 4);
+		memcpy(nb, &x, sizeof(x));
+		buf_free(b.buf);
+		b.buf = nb;
+		b.sz = b.solong = raw + 4;
+		return true;
+	}
+
+	// turn a received msg back into a plain one: verify and drop its trailer,
+	// then decompress it. false if it is corrupt, b.buf stays valid either way.
+	// a peer that seals its msgs gets sealed msgs back
+	bool unwrap(buffer &b) {
+		uint32_t x, flags;
+		memcpy(&x, b.buf, sizeof(x));
+		flags = ntohl(x) & MSG_FLAGS;
+		if (flags & MSG_LZ_OK) lz_peer_ = true;
+		if (flags & MSG_CRC_FLAG) {
+			if (!check_msg(b)) return false;
+		} else if (crc_in_) {
+			// a peer that seals never stops, so a flipped flag bit is no way around the check
+			uint64_t n = ++bad_msgs_;
+			if (log_bad(n))
+				printf("Connection::unwrap(fd_ %d) unsealed msg of size %d, %lu bad msgs so far\n",
+						fd_, b.sz, (unsigned long)n);
+			return false;
+		}
+		if (flags & MSG_LZ_FLAG && !decompress(b)) {
+			uint64_t n = ++bad_msgs_;
+			if (log_bad(n))
+				printf("Connection::unwrap(fd_ %d) bad compressed msg of size %d, %lu bad msgs so far\n",
+						fd_, b.sz, (unsigned long)n);
+			return false;
+		}
+		return true;
+	}
+
+	// verify and drop the trailer of a received msg, false on a mismatch
+	bool check_msg(buffer &b) {
+		uint32_t x;
+		memcpy(&x, b.buf + b.sz - 4, sizeof(x));
+		uint32_t crc = crc32c(0, b.buf, b.sz - 4);
+		if (crc != ntohl(x)) {
+			uint64_t n = ++bad_msgs_;
+			if (log_bad(n))
+				printf("Connection::check_msg(fd_ %d) bad checksum of msg size %d, %x != %x, %lu bad msgs so far\n",
+						fd_, b.sz, crc, ntohl(x), (unsigned long)n);
+			return false;
+		}
+		b.sz -= 4;
+		b.solong -= 4;
+		crc_in_ = true;
+		crc_ = true;
+		return true;
+	}
+
+	// split complete msgs out of rslab into rbufq, return false on a bad msg
+	bool split_msgs(int *cnt) {
+		int pos = 0;
+		while (rslab_len - pos >= (int)sizeof(uint32_t)) {
+			uint32_t sz, sz_raw;
+			memcpy(&sz_raw, rslab + pos, sizeof(sz_raw));
 
 			// network to host
 			sz = ntohl(sz_raw);
+			uint32_t trailer = sz & MSG_CRC_FLAG ? 4 : 0;
+			sz &= ~MSG_FLAGS;
 
-			if (sz > MAX_MSG_SZ) {
+			if (sz > MAX_MSG_SZ + trailer || sz < sizeof(sz) + trailer) {
 				char *tmpb = (char *)&sz_raw;
-				printf("Connection::read_msg(fd_ %d) read msg TOO BIG %d network order=%x %x %x %x %x\n", fd_, sz, 
+				printf("Connection::split_msgs(fd_ %d) read msg TOO BIG %d network order=%x %x %x %x %x\n", fd_, sz, 
 						sz_raw, tmpb[0],tmpb[1],tmpb[2],tmpb[3]);
 				return false;
 			}
 
-			rbuf.sz = sz;
-			VERIFY(rbuf.buf == NULL);
-			rbuf.buf = (char *)malloc(sz);
-			VERIFY(rbuf.buf);
-			bcopy(&sz_raw, rbuf.buf, sizeof(sz));
-			rbuf.solong = sizeof(sz);
+			int have = rslab_len - pos;
+			if (have < (int)sz && sz <= RSLAB_SZ) break;	// rest of msg fits in rslab
+
+			char *b = buf_alloc(sz);
+			if (have < (int)sz) {
+				// too large for rslab, the rest is read into its own buffer
+				memcpy(b, rslab + pos, have);
+				rbuf = buffer(b, sz);
+				rbuf.solong = have;
+				pos = rslab_len;
+				break;
+			}
+			memcpy(b, rslab + pos, sz);
+			buffer msg(b, sz);
+			msg.solong = sz;
+			if (!unwrap(msg)) {
+				buf_free(msg.buf);
+				return false;
+			}
+			rbufq.push(msg);
+			pos += sz;
+			(*cnt)++;
 		}
 
-		// read data
-		// printf("Connection::read_msg try to read %d byte buffer from fd %d\n", (rbuf.sz - rbuf.solong), fd_);
-		int n = read(fd_, rbuf.buf + rbuf.solong, rbuf.sz - rbuf.solong);
-		// printf("Connection::read_msg read %d bytes\n", n);
-		if (n <= 0) {
-			if (errno == EAGAIN) return true;
-
-			// reset rbuf for next message
-			printf("Connection::read_msg(fd_ %d) failure, errno = %d\n", fd_, errno);
-			return false;
-		}
-		rbuf.solong += n;
+		// move the partial msg to the front
+		rslab_len -= pos;
+		if (rslab_len > 0 && pos > 0) memmove(rslab, rslab + pos, rslab_len);
 		return true;
 	}
 
-	// write wbuffer to a msg, may not complete a msg
-    bool write_msg() {
-		// printf("---Connection::write_msg---\n");
-		VERIFY(wbuf.buf);
-		VERIFY(wbuf.sz);
-		if (wbuf.sz == wbuf.solong) return true;    // already finished
-
-		// host to network
-		if (wbuf.solong == 0) {
-			int sz = htonl(wbuf.sz);
-			bcopy(&sz, wbuf.buf,sizeof(sz));
+	// one recv into rslab (or rbuf for a large msg), then split out complete msgs.
+	// fd_ is non-blocking, so a slow peer costs an EAGAIN instead of a stall.
+	// return < 0 on failure, 0 if the socket is drained, 1 if more may be pending
+    int read_msgs(int *cnt) {
+		// printf("---Connection::read_msgs---\n");
+		char *dst;
+		int want;
+		if (!rbuf.empty()) {
+			dst = rbuf.buf + rbuf.solong;
+			want = rbuf.sz - rbuf.solong;
+		} else {
+			if (!rslab) {
+				rslab = buf_alloc(RSLAB_SZ);
+			}
+			dst = rslab + rslab_len;
+			want = RSLAB_SZ - rslab_len;
 		}
 
-		// write data
-		// printf("Connection::write_msg before write, wbuf.buf[7] = %x\n", wbuf.buf[7]);
-		int n = write(fd_, wbuf.buf + wbuf.solong, (wbuf.sz - wbuf.solong));
-		// printf("Connection::write_msg write %d bytes\n", n);
+		// read data
+		ssize_t n = recv(fd_, dst, want, 0);
+		// printf("Connection::read_msgs read %ld of %d bytes\n", n, want);
+		if (n == 0) return -1;	// peer closed
 		if (n < 0) {
-			if (errno != EAGAIN) {
-				printf("Connection::write_msg(fd_ %d) failure, errno = %d\n", fd_, errno);
-				wbuf.solong = -1;
-				wbuf.sz = 0;
+			if (errno == EINTR) return 1;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			printf("Connection::read_msgs(fd_ %d) failure, errno = %d\n", fd_, errno);
+			return -1;
+		}
+
+		if (!rbuf.empty()) {
+			rbuf.solong += n;
+			if (rbuf.solong == rbuf.sz) {
+				if (!unwrap(rbuf)) return -1;
+				rbufq.push(rbuf);
+				rbuf.reset();
+				(*cnt)++;
 			}
-			return (errno == EAGAIN);
+		} else {
+			rslab_len += n;
+			if (!split_msgs(cnt)) return -1;
 		}
-		wbuf.solong += n;
-		if (wbuf.sz == wbuf.solong) {
-			free(wbuf.buf);
-			wbuf.reset();
+
+		// short read means socket buffer is empty
+		return n < want ? 0 : 1;
+	}
+
+	// send the blob of the front msg once its buffer is out.
+	// return < 0 on failure, 0 if the socket is full, 1 when it is done
+	int send_file() {
+		rpc_file f;
+		size_t sent;
+		{
+			ScopedLock wl(&wm_);
+			f = wbufq.front().file;
+			sent = wbufq.front().fsent;
 		}
-		return true;
+
+		// straight from the page cache to the socket
+		int ret = 1;
+		while (sent < f.len) {
+			off_t off = f.off + sent;
+			ssize_t n = sendfile(fd_, f.fd, &off, f.len - sent);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {ret = 0; break;}
+				printf("Connection::send_file(fd_ %d) failure, errno = %d\n", fd_, errno);
+				return -1;
+			}
+			if (n == 0) {
+				// the length is already out, the stream cannot recover
+				printf("Connection::send_file(fd_ %d) file %d ended early\n", fd_, f.fd);
+				return -1;
+			}
+			sent += n;
+		}
+
+		ScopedLock wl(&wm_);
+		buffer &b = wbufq.front();
+		b.fsent = sent;
+		if (ret == 1) {
+			b.clear();
+			wbufq.pop_front();
+		}
+		return ret;
 	}
-		
-	// get the fd_set(only include fd_) of connection
-	fd_set get_fd_set() {
-		fd_set rfds;
-		FD_ZERO(&rfds);
-		FD_SET(fd_, &rfds);
-		return rfds;
-	}		
 
+	// write queued msgs gathered into one sendmsg per round, may not complete a msg.
+	// only the writing thread pops wbufq, others only push to its back,
+	// so the gathered buffers stay valid while wm_ is released for the syscall.
+	// a msg with a blob ends the gather, the blob goes out with sendfile.
+	// completions of zerocopy sends are reaped here too, as they raise
+	// EPOLLERR which the loops handle as writable
+	bool write_msgs() {
+		// printf("---Connection::write_msgs---\n");
+		struct iovec iov[MAX_IOV_CNT];
+		if (!zc_held_.empty()) reap_zerocopy();
+		while (1) {
+			// gather queued msgs
+			int cnt = 0;
+			size_t total = 0;
+			bool file = false;	// the last gathered msg has a blob
+			bool zc = false;	// a single large msg sent with MSG_ZEROCOPY
+			{
+				ScopedLock wl(&wm_);
+				for (auto it = wbufq.begin(); it != wbufq.end() && cnt < MAX_IOV_CNT; it++, cnt++) {
+					VERIFY(it->buf && it->sz);
+					// a large msg goes alone, after the small ones before it
+					if (zerocopy_msg(*it)) {
+						if (cnt > 0) break;
+						zc = true;
+					}
+					// host to network, the size covers the blob
+					if (it->solong == 0) {
+						int sz = htonl(wire_sz(*it));
+						bcopy(&sz, it->buf, sizeof(sz));
+					}
+					iov[cnt].iov_base = it->buf + it->solong;
+					iov[cnt].iov_len = it->sz - it->solong;
+					total += iov[cnt].iov_len;
+					if (zc) {
+						cnt++;
+						break;
+					}
+					if (it->file.fd >= 0) {
+						file = true;
+						cnt++;
+						break;
+					}
+				}
+			}
+			if (cnt == 0) return true;
+
+			// write data
+			ssize_t n = 0;
+			if (total > 0) {
+				struct msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = iov;
+				msg.msg_iovlen = cnt;
+				n = sendmsg(fd_, &msg, MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0));
+				// printf("Connection::write_msgs write %ld of %lu bytes in %d msgs\n", n, total, cnt);
+				if (n < 0) {
+					if (errno == EINTR) continue;
+					if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+					printf("Connection::write_msgs(fd_ %d) failure, errno = %d\n", fd_, errno);
+					return false;
+				}
+				if (zc) zc_next_++;
+			}
+
+			{
+				// release finished msgs, a partial one stays at the front.
+				// so does one whose blob is not sent yet
+				ScopedLock wl(&wm_);
+				size_t left = n;
+				while (left > 0) {
+					buffer &b = wbufq.front();
+					size_t rest = b.sz - b.solong;
+					if (left < rest || b.file.fd >= 0) {
+						b.solong += std::min(left, rest);
+						break;
+					}
+					left -= rest;
+					// the kernel may still read a zerocopy buffer
+					if (zc) zc_held_.push_back(std::make_pair(zc_next_ - 1, b.buf));
+					else buf_free(b.buf);
+					wbufq.pop_front();
+				}
+			}
+
+			// short write means socket buffer is full
+			if ((size_t)n < total) return true;
+			if (file) {
+				int ret = send_file();
+				if (ret < 0) return false;
+				if (ret == 0) return true;
+			}
+		}
+	}
+		
 public:
-	Connection(int fd): fd_(fd), dead_(false) {
+	bool wr_armed;		// write interest armed in the event loop
+	unsigned int clt_id;	// client of a server side conn, 0 until its first msg
+
+	// fd must be non-blocking, e.g. from accept4(SOCK_NONBLOCK)
+	Connection(int fd): fd_(fd), dead_(false), refno_(1), 
+		rslab(NULL), rslab_len(0), crc_(false), crc_in_(false), lz_min_(0), lz_peer_(false), zc_min_(0), zc_next_(0), zc_done_(0), wr_armed(false), clt_id(0) {
+		VERIFY(fcntl(fd_, F_GETFL, NULL) & O_NONBLOCK);
 		VERIFY(pthread_mutex_init(&m_,0) == 0);
 		VERIFY(pthread_mutex_init(&wm_,0) == 0);
 		VERIFY(pthread_mutex_init(&rm_,0) == 0);
 	}
 
 	// for creating Connection to certain addr
-	Connection(const sockaddr_in &dst) {
-		int s= socket(AF_INET, SOCK_STREAM, 0);
+	Connection(const sockaddr_in &dst): refno_(1), 
+		rslab(NULL), rslab_len(0), crc_(false), crc_in_(false), lz_min_(0), lz_peer_(false), zc_min_(0), zc_next_(0), zc_done_(0), wr_armed(false), clt_id(0) {
+		int s= socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 		int yes = 1;
 		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
 		if(connect(s, (sockaddr*)&dst, sizeof(dst)) < 0) {
@@ -176,6 +508,10 @@ public:
 			return;
 		}
 		// printf("connect_to_dst fd=%d to dst %s:%d\n", s, inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
+
+		// only connect blocks, all later io is driven by EAGAIN
+		int flags = fcntl(s, F_GETFL, NULL);
+		fcntl(s, F_SETFL, flags | O_NONBLOCK);
 		
 		fd_ = s;
 		dead_ = false;
@@ -186,16 +522,17 @@ public:
 
 	~Connection() {
 		// free buffer
-		wbuf.clear();
 		rbuf.clear();
-		for (size_t i = 0; i < wbufq.size(); i++) {
+		if (rslab) buf_free(rslab);
+		while (!wbufq.empty()) {
 			wbufq.front().clear();
-			wbufq.pop();
+			wbufq.pop_front();
 		}
-		for (size_t i = 0; i < rbufq.size(); i++) {
+		while (!rbufq.empty()) {
 			rbufq.front().clear();
 			rbufq.pop();
 		}
+		for (auto &&h : zc_held_) buf_free(h.second);
 
 		// close connection
 		closeCh();
@@ -207,17 +544,74 @@ public:
 
 	void closeCh() {
 		ScopedLock lock(&m_);
-		close(fd_);
+		if (fd_ >= 0) close(fd_);
+		fd_ = -1;
 		dead_ = true;
 	}
 
+	// send msgs of at least min bytes with MSG_ZEROCOPY, 0 turns it off.
+	// saves the copy into the kernel for large msgs, at the cost of a
+	// completion per send. return false if the kernel does not support it
+	bool zerocopy(size_t min) {
+		ScopedLock lock(&m_);
+		if (fd_ < 0) return false;
+		int on = 1;
+		if (min > 0 && setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+			printf("Connection::zerocopy(fd_ %d) not supported, errno = %d\n", fd_, errno);
+			return false;
+		}
+		zc_min_ = min;
+		return true;
+	}
+
+	// end every msg sent from now on with a CRC32C of it, checked by the
+	// receiver before the msg is handed out. the peer answers in kind
+	void checksum(bool on) { crc_ = on; }
+	bool checksummed() { return crc_; }
+	bool peer_checksummed() { return crc_in_; }
+
+	// msgs dropped so far for a bad checksum or compressed block, over all conns
+	static uint64_t bad_msgs() { return bad_msgs_; }
+
+	// a peer can send bad msgs as fast as it likes, so only the 1st, 2nd,
+	// 4th, ... is logged
+	static bool log_bad(uint64_t n) { return (n & (n - 1)) == 0; }
+
+	// compress msgs of at least min bytes once the peer is known to take
+	// them, and tell it this side does. 0 turns it off, received compressed
+	// msgs are always taken
+	void compression(size_t min) { lz_min_ = min; }
+	bool compressing() { return lz_min_ > 0; }
+	bool peer_compresses() { return lz_peer_; }
+
+	// compress and seal msg b as negotiated with the peer, done once per msg.
+	// callers off the loop thread may do it themselves to spread the work
+	void prepare(buffer &b) {
+		if (b.prepared) return;
+		b.prepared = true;
+		size_t min = lz_min_;
+		if (min) {
+			b.flags |= MSG_LZ_OK;
+			if (lz_peer_ && (size_t)b.sz >= min) compress(b);
+		}
+		if (crc_) seal(b);
+	}
+
+	// keep connection alive while other threads use it
+	void incref() { refno_++; }
+
+	// delete connection when last reference is dropped
+	void decref() {
+		if (--refno_ == 0) delete this;
+	}
+
 	bool is_dead() {return dead_;}	// if connection has ended
 	int channo() {return fd_;}		// connetion fd_			
 
-	// if wbuf and wbufq is empty
+	// if wbufq is empty
 	bool empty_wbuf() {
 		ScopedLock lock(&wm_);
-		return (wbuf.empty() && wbufq.empty());
+		return wbufq.empty();
 	}
 		
 	// rbuf size
@@ -244,7 +638,7 @@ public:
 	buffer next_wbuf() {
 		ScopedLock lock(&wm_);
 		buffer buf = wbufq.front();
-		wbufq.pop();
+		wbufq.pop_front();
 		return buf;
 	}
 
@@ -256,40 +650,34 @@ public:
 
 	// produce next wbuf
 	void add_wbuf(buffer buf) {
+		prepare(buf);
 		ScopedLock lock(&wm_);
-		wbufq.push(buf);
+		wbufq.push_back(buf);
 	}
 
 	// fd_ is ready to be read
-	void read_cb() {
+	// return true if MAX_MSG_CNT msgs were read and more may be pending
+	bool read_cb() {
 		// printf("---Connection::read_cb---\n");
-		if (dead_) return;
+		if (dead_) return false;
 
 		// when socket is ready for read
+		ScopedLock cl(&m_);
+		ScopedLock rl(&rm_);
 		int cnt = 0;	// msg cnt
 		while (cnt < MAX_MSG_CNT) {
-			// non-blocking select to check read readiness
-			fd_set rfds = get_fd_set();
-			struct timeval timeout = {0,0};
-			if (select(fd_ + 1, &rfds, NULL, NULL, &timeout) != 1) break;
-
-			// read buffer
-			ScopedLock cl(&m_);
-			ScopedLock rl(&rm_);
-			bool succ = true;
-			if (rbuf.empty() || rbuf.solong < rbuf.sz)	// if rbuf is not filled yet
-				succ = read_msg();
-
-			if (!succ) {dead_ = true; break;}
-
-			if (!rbuf.empty() && rbuf.sz == rbuf.solong) {
-				cnt++;
-				// enqueue
-				rbufq.push(rbuf);
-				// reset rbuf
-				rbuf.reset();
+			int ret = read_msgs(&cnt);
+			if (ret < 0) {dead_ = true; return false;}
+			if (ret == 0) {
+				// drained, an idle conn holds no slab
+				if (rslab && !rslab_len) {
+					buf_free(rslab);
+					rslab = NULL;
+				}
+				return false;
 			}
 		}
+		return true;
 	}
 
 	// fd_ is ready to be write
@@ -298,41 +686,66 @@ public:
 		if (dead_) return;
 
 		// when socket is ready for write
-		int cnt = 0;	// msg cnt
-		while (cnt < MAX_MSG_CNT) {
-			if (empty_wbuf()) return;	// nothing to write
-			if (wbuf.empty()) {
-				wbuf = wbufq.front();
-				wbuf.solong = 0;
-				wbufq.pop();
-			}
-
-			// non-blocking select to check write readiness
-			fd_set wfds = get_fd_set();
-			struct timeval timeout = {0,0};
-			if (select(fd_ + 1, NULL, &wfds, NULL, &timeout) != 1) break;
-
-			// write buffer
-			ScopedLock cl(&m_);
-			ScopedLock wl(&wm_);
-			bool succ = true;
-			if (wbuf.buf && wbuf.solong < wbuf.sz)	// if wbuf is not finished yet
-				succ = write_msg();
-
-			if (!succ) {dead_ = true; break;}
-		}
+		ScopedLock cl(&m_);
+		if (!write_msgs()) dead_ = true;
 	}
 		
-	// send certain size of data
-	bool send(char *buf, size_t sz) {
-		// printf("---Connection::send(buf = %p, sz = %lu)---\n", buf, sz);
+	// send a msg, the buffer (and its blob, if any) is owned by the conn from now on
+	bool send(buffer msg) {
+		// printf("---Connection::send(buf = %p, sz = %d)---\n", msg.buf, msg.sz);
+		prepare(msg);
 		{
 			ScopedLock lock(&wm_);
-			wbufq.push(buffer(buf, sz));
+			wbufq.push_back(msg);
 		}
 
 		// try to send data
 		write_cb();
 		return empty_wbuf();
 	}
+
+	// send a msg the caller keeps, e.g. one built in a marshall's inline buffer.
+	// it goes out right away if nothing is queued before it, only what the
+	// socket does not take is copied into a buffer of the queue.
+	// a msg to be sealed or compressed is always copied, the caller's buffer may have no room
+	void send_copy(char *buf, size_t sz) {
+		if (dead_) return;
+
+		ScopedLock cl(&m_);
+		size_t n = 0;
+		size_t lz_min = lz_min_;
+		uint32_t flags = lz_min ? MSG_LZ_OK : 0;
+		bool plain = !crc_ && !(lz_min && lz_peer_ && sz >= lz_min);
+		if (plain && empty_wbuf()) {
+			// host to network
+			int nsz = htonl(sz | flags);
+			bcopy(&nsz, buf, sizeof(nsz));
+			ssize_t ret;
+			while ((ret = ::send(fd_, buf, sz, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+			if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				printf("Connection::send_copy(fd_ %d) failure, errno = %d\n", fd_, errno);
+				dead_ = true;
+				return;
+			}
+			if (ret > 0) n = ret;
+			if (n == sz) return;
+		}
+
+		buffer msg(buf_alloc(sz), sz);
+		memcpy(msg.buf, buf, sz);
+		msg.solong = n;
+		if (n > 0) {
+			// the prefix is out already
+			msg.flags = flags;
+			msg.prepared = true;
+		}
+		prepare(msg);
+		{
+			// a partly sent msg has to go out before anything queued meanwhile
+			ScopedLock wl(&wm_);
+			if (n > 0) wbufq.push_front(msg);
+			else wbufq.push_back(msg);
+		}
+		if (!write_msgs()) dead_ = true;
+	}
 };
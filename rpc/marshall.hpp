@@ -3,22 +3,37 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
 #include <cstddef>
 #include <inttypes.h>
+#include <endian.h>
+#include <type_traits>
 #include "utils/verify.h"
 #include "utils/algorithm.h"
+#include "utils/byteswap.h"
+#include "bufpool.hpp"
+
+// set in the proc word of a request whose reply the server keeps for a retransmit
+#define RPC_PROC_CACHED 0x40000000
 
 struct req_header {
-	req_header(int r = 0, int p = 0, int c = 0, int s = 0):
-		rid(r), proc(p), clt_id(c), srv_id(s){}
+	req_header(int r = 0, int p = 0, int c = 0, int s = 0, int x = 0, unsigned int b = 0):
+		rid(r), proc(p), clt_id(c), srv_id(s), xid_rep(x), budget(b), cached(false){}
 	int rid;				// request id
 	int proc;				// rpc code
 	unsigned int clt_id;	// client id
 	unsigned int srv_id;	// server id
+	int xid_rep;			// the client is done with every rid up to this one
+	unsigned int budget;	// usec left before the client gives up, 0 if it never does
+	bool cached;			// the client may retransmit it, see RPC_PROC_CACHED
 };
 
 struct reply_header {
@@ -27,59 +42,212 @@ struct reply_header {
 	int result;				// rpc reply code
 };
 
-typedef uint64_t rpc_checksum_t;
 typedef int rpc_sz_t;
 
 enum {
-	//size of initial buffer allocation 
-	DEFAULT_RPC_SZ = 1024,
-#if RPC_CHECKSUMMING
-	//size of rpc_header includes a 4-byte int to be filled by tcpchan and uint64_t checksum
-	RPC_HEADER_SZ = static_max<sizeof(req_header), sizeof(reply_header)>::value + sizeof(rpc_sz_t) + sizeof(rpc_checksum_t)
-#else
-		RPC_HEADER_SZ = static_max<sizeof(req_header), sizeof(reply_header)>::value + sizeof(rpc_sz_t)
-#endif
+	//size of the inline buffer, smaller msgs are built without the buffer pool
+	DEFAULT_RPC_SZ = 256,
+	//size of rpc_header includes a 4-byte int to be filled by tcpchan.
+	//a checksum, if any, goes in a trailer, see Connection::seal.
+	//a req_header is 6 words on the wire, cached rides in the proc word
+	RPC_HEADER_SZ = static_max<6 * 4, sizeof(reply_header)>::value + sizeof(rpc_sz_t),
+	//where pack_req_header puts the budget, so a copy can be updated in place
+	RPC_BUDGET_OFF = sizeof(rpc_sz_t) + 5 * 4
+};
+
+// integer types whose vectors are marshalled as one block of
+// fixed-width big-endian elements
+template <class C>
+struct is_wire_int {
+	static const bool value = std::is_integral<C>::value && !std::is_same<C, bool>::value;
+};
+
+// encoded size of a value, so a msg can be allocated once before marshalling.
+// fixed-width types are known at compile time, strings and containers
+// take a pass over their lengths. 0 for unknown types, marshall grows for them
+template <class T, class = void>
+struct wire_sizer {
+	static size_t size(const T &) { return 0; }
+};
+
+template <class T>
+struct wire_sizer<T, std::enable_if_t<std::is_integral<T>::value>> {
+	static constexpr size_t size(const T &) { return sizeof(T); }
+};
+
+template <>
+struct wire_sizer<std::string> {
+	static size_t size(const std::string &s) { return 4 + s.size(); }
+};
+
+template <>
+struct wire_sizer<std::string_view> {
+	static size_t size(std::string_view s) { return 4 + s.size(); }
+};
+
+template <class C>
+struct wire_sizer<std::vector<C>> {
+	static size_t size(const std::vector<C> &v) {
+		if constexpr (is_wire_int<C>::value) {
+			return 4 + v.size() * sizeof(C);
+		} else {
+			size_t n = 4;
+			for (const auto &x : v) n += wire_sizer<C>::size(x);
+			return n;
+		}
+	}
 };
 
+template <class A, class B>
+struct wire_sizer<std::map<A, B>> {
+	static size_t size(const std::map<A, B> &d) {
+		if constexpr (std::is_integral<A>::value && std::is_integral<B>::value) {
+			return 4 + d.size() * (sizeof(A) + sizeof(B));
+		} else {
+			size_t n = 4;
+			for (auto &&kv : d) n += wire_sizer<A>::size(kv.first) + wire_sizer<B>::size(kv.second);
+			return n;
+		}
+	}
+};
+
+// a blob held in a file, on the wire it is a std::string.
+// as the reply of a handler it is sent from the page cache with sendfile
+// and never copied into a msg buffer, the server closes fd once it is sent.
+// as the reply of a call the blob is written to fd at off instead of into memory
+struct rpc_file {
+	int fd;
+	off_t off;
+	size_t len;		// bytes from off, set to the bytes written on the client
+
+	rpc_file(int f = -1, off_t o = 0, size_t l = 0): fd(f), off(o), len(l) {}
+};
+
+// only the length goes into the buffer
+template <>
+struct wire_sizer<rpc_file> {
+	static size_t size(const rpc_file &) { return 4; }
+};
+
+template <class... Args>
+inline size_t wire_size(const Args &... args) {
+	return (0 + ... + wire_sizer<Args>::size(args));
+}
+
 class marshall {
 	private:
 		char *_buf;     // Base of the raw bytes buffer (dynamically readjusted)
 		int _capa;      // Capacity of the buffer
 		int _ind;       // Read/write head position
+		char _small[DEFAULT_RPC_SZ];	// inline buffer of small msgs
+		rpc_file _file;	// blob sent after the buffer, fd is -1 if there is none
+
+		// read the pending blob into the buffer, as anything written after it
+		// must follow it on the wire
+		void inline_file() {
+			if (_file.fd < 0) return;
+			rpc_file f = _file;
+			_file = rpc_file();
+			reserve(f.len);
+			size_t done = 0;
+			while (done < f.len) {
+				ssize_t n = pread(f.fd, _buf + _ind + done, f.len - done, f.off + done);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) {
+					// the length is already out, pad a short file with zeros
+					printf("marshall::inline_file(fd %d) short read, errno = %d\n", f.fd, errno);
+					memset(_buf + _ind + done, 0, f.len - done);
+					break;
+				}
+				done += n;
+			}
+			_ind += f.len;
+			close(f.fd);
+		}
 
 	public:
-		marshall() {
-			_buf = (char *) malloc(sizeof(char)*DEFAULT_RPC_SZ);
-			VERIFY(_buf);
-			memset(_buf, 0, DEFAULT_RPC_SZ);
-			_capa = DEFAULT_RPC_SZ;
+		// body is the expected size after the header, see wire_size.
+		// a msg that fits in DEFAULT_RPC_SZ is built inline, a larger one
+		// gets a single buffer of the exact size
+		marshall(size_t body = 0) {
+			size_t sz = RPC_HEADER_SZ + body;
+			if (sz <= DEFAULT_RPC_SZ) {
+				_buf = _small;
+				_capa = DEFAULT_RPC_SZ;
+			} else {
+				VERIFY(sz <= INT32_MAX);
+				_buf = buf_alloc(sz);
+				_capa = sz;
+			}
+			// only the header may go out unwritten
+			memset(_buf, 0, RPC_HEADER_SZ);
 			_ind = RPC_HEADER_SZ;
 		}
 
+		// _buf may point into this obj
+		marshall(const marshall &) = delete;
+		marshall &operator=(const marshall &) = delete;
+
+		// the buffer is freed unless it was taken
 		~marshall() { 
-			// if (_buf) free(_buf); 
+			if (_buf != _small) buf_free(_buf); 
+			if (_file.fd >= 0) close(_file.fd);
 		}
 
-		int size() { return _ind;}
+		int size() { return _ind;}	// bytes in the buffer, without a pending blob
 		char *cstr() { return _buf;}
-
-		void rawbyte(unsigned char x) {
-			if(_ind >= _capa){
-				_capa *= 2;
+		bool inlined() { return _buf == _small;}	// if still in the inline buffer
+		bool has_file() { return _file.fd >= 0;}	// if a blob goes out after the buffer
+		const rpc_file &file() { return _file;}		// the pending blob
+
+		// make the msg a plain buffer, a pending blob is read in
+		void flatten() { inline_file(); }
+
+		// make room for n more bytes, so the put helpers need no check.
+		// reserving the whole remaining size up front allocates exactly once
+		void reserve(size_t n) {
+			if (_file.fd >= 0) inline_file();
+			if(_ind + n > (size_t)_capa){
+				size_t capa = 2 * (size_t)_capa;
+				if(capa < _ind + n)
+					capa = _ind + n;
+				VERIFY(capa <= INT32_MAX);
 				VERIFY (_buf != NULL);
-				_buf = (char *)realloc(_buf, _capa);
-				VERIFY(_buf);
+				// only the written bytes are copied
+				char *b = buf_alloc(capa);
+				memcpy(b, _buf, _ind);
+				if (_buf != _small) buf_free(_buf);
+				_buf = b;
+				_capa = capa;
 			}
+		}
+
+		// unchecked big-endian stores, the caller reserves first
+		void put16(uint16_t x) {
+			x = htobe16(x);
+			memcpy(_buf + _ind, &x, 2);
+			_ind += 2;
+		}
+
+		void put32(uint32_t x) {
+			x = htobe32(x);
+			memcpy(_buf + _ind, &x, 4);
+			_ind += 4;
+		}
+
+		void put64(uint64_t x) {
+			x = htobe64(x);
+			memcpy(_buf + _ind, &x, 8);
+			_ind += 8;
+		}
+
+		void rawbyte(unsigned char x) {
+			reserve(1);
 			_buf[_ind++] = x;
 		}
 
 		void rawbytes(const char *p, int n) {
-			if((_ind+n) > _capa){
-				_capa = _capa > n? 2*_capa:(_capa+n);
-				VERIFY (_buf != NULL);
-				_buf = (char *)realloc(_buf, _capa);
-				VERIFY(_buf);
-			}
+			reserve(n);
 			memcpy(_buf+_ind, p, n);
 			_ind += n;
 		}
@@ -94,23 +262,22 @@ class marshall {
 		}
 
 		void pack(int x) {
-			rawbyte((x >> 24) & 0xff);
-			rawbyte((x >> 16) & 0xff);
-			rawbyte((x >> 8) & 0xff);
-			rawbyte(x & 0xff);
+			reserve(4);
+			put32(x);
 		}
 
+		// the header room is always there, so nothing is reserved
+		// (which would also read in a pending blob)
 		void pack_req_header(const req_header &h) {
 			int saved_sz = _ind;
 			//leave the first 4-byte empty for channel to fill size of pdu
 			_ind = sizeof(rpc_sz_t); 
-#if RPC_CHECKSUMMING
-			_ind += sizeof(rpc_checksum_t);
-#endif
-			pack(h.rid);
-			pack(h.proc);
-			pack((int)h.clt_id);
-			pack((int)h.srv_id);
+			put32(h.rid);
+			put32(h.proc | (h.cached ? RPC_PROC_CACHED : 0));
+			put32((int)h.clt_id);
+			put32((int)h.srv_id);
+			put32(h.xid_rep);
+			put32((int)h.budget);
 			_ind = saved_sz;
 		}
 
@@ -118,16 +285,36 @@ class marshall {
 			int saved_sz = _ind;
 			//leave the first 4-byte empty for channel to fill size of pdu
 			_ind = sizeof(rpc_sz_t); 
-#if RPC_CHECKSUMMING
-			_ind += sizeof(rpc_checksum_t);
-#endif
-			pack(h.rid);
-			pack(h.result);
+			put32(h.rid);
+			put32(h.result);
 			_ind = saved_sz;
 		}
 
+		// overwrite a 4-byte field written before at offset at
+		void patch(int at, unsigned int x) {
+			VERIFY(at >= 0 && at + 4 <= _ind);
+			x = htobe32(x);
+			memcpy(_buf + at, &x, 4);
+		}
+
+		// hand the msg over as a pool buffer, an inline msg is copied out
 		void take_buf(char **b, int *s) {
-			*b = _buf;
+			inline_file();
+			take_buf(b, s, NULL);
+		}
+
+		// same, but a pending blob is handed over in f instead of read in
+		void take_buf(char **b, int *s, rpc_file *f) {
+			if (f) {
+				*f = _file;
+				_file = rpc_file();
+			}
+			if (_buf == _small) {
+				*b = buf_alloc(_ind);
+				memcpy(*b, _small, _ind);
+			} else {
+				*b = _buf;
+			}
 			*s = _ind;
 			_buf = NULL;
 			_ind = 0;
@@ -160,8 +347,8 @@ class marshall {
 		marshall &
 		operator<<(unsigned short x)
 		{
-			rawbyte((x >> 8) & 0xff);
-			rawbyte(x & 0xff);
+			reserve(2);
+			put16(x);
 			return *this;
 		}
 
@@ -176,11 +363,8 @@ class marshall {
 		operator<<(unsigned int x)
 		{
 			// network order is big-endian
-				// lab7: write marshall code for unsigned int type here
-			rawbyte((x >> 24) & 0xff);
-			rawbyte((x >> 16) & 0xff);
-			rawbyte((x >> 8) & 0xff);
-			rawbyte(x & 0xff);
+			reserve(4);
+			put32(x);
 			return *this;
 		}
 
@@ -194,33 +378,71 @@ class marshall {
 		marshall &
 		operator<<(const std::string &s)
 		{
-			*this << (unsigned int) s.size();
-			rawbytes(s.data(), s.size());
+			reserve(4 + s.size());
+			put32(s.size());
+			memcpy(_buf + _ind, s.data(), s.size());
+			_ind += s.size();
+			return *this;
+		}
+
+		// same wire format as std::string
+		marshall &
+		operator<<(std::string_view s)
+		{
+			reserve(4 + s.size());
+			put32(s.size());
+			// an empty view may have a null data()
+			if (s.size()) memcpy(_buf + _ind, s.data(), s.size());
+			_ind += s.size();
 			return *this;
 		}
 
 		marshall &
 		operator<<(unsigned long long x)
 		{
-			*this << (unsigned int) (x >> 32);
-			*this << (unsigned int) x;
+			reserve(8);
+			put64(x);
 			return *this;
 		}
 
 		marshall &
 		operator<<(uint64_t x)
 		{
-			*this << (unsigned int) (x >> 32);
-			*this << (unsigned int) x;
+			reserve(8);
+			put64(x);
+			return *this;
+		}
+
+		// only the length is written, the blob follows the buffer on the wire.
+		// the fd is owned by this obj from now on, no fd is an empty blob
+		marshall &
+		operator<<(const rpc_file &f)
+		{
+			VERIFY(f.len <= UINT32_MAX);
+			reserve(4);
+			if (f.fd < 0) {
+				put32(0);
+				return *this;
+			}
+			put32(f.len);
+			_file = f;
 			return *this;
 		}
 
 		template <class C> marshall &
-		operator<<(std::vector<C> v)
+		operator<<(const std::vector<C> &v)
 		{
-			*this << (unsigned int) v.size();
-			for(unsigned i = 0; i < v.size(); i++)
-				*this << v[i];
+			if constexpr (is_wire_int<C>::value) {
+				// one capacity check and a vectorized swap for the whole block
+				reserve(4 + v.size() * sizeof(C));
+				put32(v.size());
+				wire_copy<sizeof(C)>(_buf + _ind, (const char *)v.data(), v.size());
+				_ind += v.size() * sizeof(C);
+			} else {
+				*this << (unsigned int) v.size();
+				for(unsigned i = 0; i < v.size(); i++)
+					*this << v[i];
+			}
 			return *this;
 		}
 
@@ -253,22 +475,31 @@ class unmarshall {
 		int _sz;
 		int _ind;
 		bool _ok;
+		bool _own;		// _buf comes from the buffer pool and is freed with this obj
+
+		void release() {
+			if(_own)
+				buf_free(_buf);
+			_buf = NULL;
+			_own = false;
+		}
 	public:
-		unmarshall(): _buf(NULL),_sz(0),_ind(0),_ok(false) {}
-		unmarshall(char *b, int sz): _buf(b),_sz(sz),_ind(),_ok(true) {}
-		unmarshall(const std::string &s) : _buf(NULL),_sz(0),_ind(0),_ok(false) 
+		unmarshall(): _buf(NULL),_sz(0),_ind(0),_ok(false),_own(false) {}
+		unmarshall(char *b, int sz, bool own = false): _buf(b),_sz(sz),_ind(),_ok(true),_own(own) {}
+		unmarshall(const std::string &s) : _buf(NULL),_sz(0),_ind(0),_ok(false),_own(false) 
 		{
 			//take the content which does not exclude a RPC header from a string
 			take_content(s);
 		}
 		~unmarshall() {
-			// if (_buf) free(_buf);
+			release();
 		}
 
-		// take the contents from another unmarshall object
+		// take the contents (and the ownership) from another unmarshall object
 		void take_in(unmarshall &another) {
-			if(_buf)
-				free(_buf);
+			release();
+			_own = another._own;
+			another._own = false;
 			another.take_buf(&_buf, &_sz);
 			_ind = RPC_HEADER_SZ;
 			_ok = _sz >= RPC_HEADER_SZ?true:false;
@@ -276,9 +507,10 @@ class unmarshall {
 
 		//take the content which does not exclude a RPC header from a string
 		void take_content(const std::string &s) {
+			release();
 			_sz = s.size() + RPC_HEADER_SZ;
-			_buf = (char *)realloc(_buf,_sz);
-			VERIFY(_buf);
+			_buf = buf_alloc(_sz);
+			_own = true;
 			_ind = RPC_HEADER_SZ;
 			memcpy(_buf+_ind, s.data(), s.size());
 			_ok = true;
@@ -296,6 +528,37 @@ class unmarshall {
 		}
 
 
+		// check once that n more bytes are there, so the get helpers need no check
+		bool need(size_t n) {
+			if(!_ok || n > (size_t)(_sz - _ind)){
+				_ok = false;
+				return false;
+			}
+			return true;
+		}
+
+		// unchecked big-endian loads, the caller checks with need first
+		uint16_t get16() {
+			uint16_t x;
+			memcpy(&x, _buf + _ind, 2);
+			_ind += 2;
+			return be16toh(x);
+		}
+
+		uint32_t get32() {
+			uint32_t x;
+			memcpy(&x, _buf + _ind, 4);
+			_ind += 4;
+			return be32toh(x);
+		}
+
+		uint64_t get64() {
+			uint64_t x;
+			memcpy(&x, _buf + _ind, 8);
+			_ind += 8;
+			return be64toh(x);
+		}
+
 		unsigned int rawbyte() {
 			char c = 0;
 			if(_ind >= _sz)
@@ -306,7 +569,7 @@ class unmarshall {
 		}
 
 		void rawbytes(std::string &ss, unsigned int n) {
-			if((_ind+n) > (unsigned)_sz){
+			if(!_ok || n > (size_t)(_sz - _ind)){
 				_ok = false;
 			} else {
 				std::string tmps = std::string(_buf+_ind, n);
@@ -316,14 +579,22 @@ class unmarshall {
 			}
 		}
 
+		// view n bytes in place instead of copying them out,
+		// only valid as long as the msg buffer is
+		void rawbytes(std::string_view &v, unsigned int n) {
+			if(!_ok || n > (size_t)(_sz - _ind)){
+				_ok = false;
+			} else {
+				v = std::string_view(_buf+_ind, n);
+				_ind += n;
+			}
+		}
+
 		int ind() { return _ind;}
 		int size() { return _sz;}
 
 		void unpack(int *x) {	//non-const ref
-			(*x) = (rawbyte() & 0xff) << 24;
-			(*x) |= (rawbyte() & 0xff) << 16;
-			(*x) |= (rawbyte() & 0xff) << 8;
-			(*x) |= rawbyte() & 0xff;
+			(*x) = need(4) ? get32() : 0;
 		}
 
 		void take_buf(char **b, int *sz) {
@@ -336,22 +607,20 @@ class unmarshall {
 		void unpack_req_header(req_header *h) {
 			//the first 4-byte is for channel to fill size of pdu
 			_ind = sizeof(rpc_sz_t); 
-#if RPC_CHECKSUMMING
-			_ind += sizeof(rpc_checksum_t);
-#endif
 			unpack(&h->rid);
 			unpack(&h->proc);
+			h->cached = h->proc & RPC_PROC_CACHED;
+			h->proc &= ~RPC_PROC_CACHED;
 			unpack((int *)&h->clt_id);
 			unpack((int *)&h->srv_id);
+			unpack(&h->xid_rep);
+			unpack((int *)&h->budget);
 			_ind = RPC_HEADER_SZ;
 		}
 
 		void unpack_reply_header(reply_header *h) {
 			//the first 4-byte is for channel to fill size of pdu
 			_ind = sizeof(rpc_sz_t); 
-#if RPC_CHECKSUMMING
-			_ind += sizeof(rpc_checksum_t);
-#endif
 			unpack(&h->rid);
 			unpack(&h->result);
 			_ind = RPC_HEADER_SZ;
@@ -383,57 +652,42 @@ class unmarshall {
 		unmarshall &
 		operator>>(unsigned short &x)
 		{
-			x = (rawbyte() & 0xff) << 8;
-			x |= rawbyte() & 0xff;
+			x = need(2) ? get16() : 0;
 			return *this;
 		}
 
 		unmarshall &
 		operator>>(short &x)
 		{
-			x = (rawbyte() & 0xff) << 8;
-			x |= rawbyte() & 0xff;
+			x = need(2) ? get16() : 0;
 			return *this;
 		}
 
 		unmarshall &
 		operator>>(unsigned int &x)
 		{
-				// lab7: write marshall code for unsigned int type here
-			x = (rawbyte() & 0xff) << 24;
-			x |= (rawbyte() & 0xff) << 16;
-			x |= (rawbyte() & 0xff) << 8;
-			x |= rawbyte() & 0xff;
+			x = need(4) ? get32() : 0;
 			return *this;
 		}
 
 		unmarshall &
 		operator>>(int &x)
 		{
-			x = (rawbyte() & 0xff) << 24;
-			x |= (rawbyte() & 0xff) << 16;
-			x |= (rawbyte() & 0xff) << 8;
-			x |= rawbyte() & 0xff;
+			x = need(4) ? get32() : 0;
 			return *this;
 		}
 
 		unmarshall &
 		operator>>(unsigned long long &x)
 		{
-			unsigned int h, l;
-			*this >> h;
-			*this >> l;
-			x = l | ((unsigned long long) h << 32);
+			x = need(8) ? get64() : 0;
 			return *this;
 		}
 
 		unmarshall &
 		operator>>(uint64_t &x)
 		{
-			unsigned int h, l;
-			*this >> h;
-			*this >> l;
-			x = l | ((uint64_t) h << 32);
+			x = need(8) ? get64() : 0;
 			return *this;
 		}
 
@@ -447,15 +701,63 @@ class unmarshall {
 			return *this;
 		}
 
+		// zero-copy flavour of std::string, the view points into the msg buffer.
+		// RPCS keeps the request buffer alive until its handler returns
+		unmarshall &
+		operator>>(std::string_view &s)
+		{
+			unsigned sz;
+			*this >> sz;
+			if(ok())
+				rawbytes(s, sz);
+			return *this;
+		}
+
+		// write a std::string (e.g. an rpc_file reply) to f.fd at f.off
+		// without building a string, f.len is set to the bytes written
+		unmarshall &
+		operator>>(rpc_file &f)
+		{
+			unsigned sz;
+			*this >> sz;
+			if(!need(sz))
+				return *this;
+			size_t done = 0;
+			while (done < sz) {
+				ssize_t n = pwrite(f.fd, _buf + _ind + done, sz - done, f.off + done);
+				if (n < 0 && errno == ESPIPE)	// a pipe or socket has no offset
+					n = write(f.fd, _buf + _ind + done, sz - done);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) {
+					_ok = false;
+					break;
+				}
+				done += n;
+			}
+			f.len = done;
+			_ind += sz;
+			return *this;
+		}
+
 		template <class C> unmarshall &
 		operator>>(std::vector<C> &v)
 		{
 			unsigned n;
 			*this >> n;
-			for(unsigned i = 0; i < n; i++){
-				C z;
-				*this >> z;
-				v.push_back(z);
+			if constexpr (is_wire_int<C>::value) {
+				// bounds are checked once for the whole block
+				if(!need((size_t)n * sizeof(C)))
+					return *this;
+				size_t base = v.size();
+				v.resize(base + n);
+				wire_copy<sizeof(C)>((char *)(v.data() + base), _buf + _ind, n);
+				_ind += n * sizeof(C);
+			} else {
+				for(unsigned i = 0; i < n && ok(); i++){
+					C z;
+					*this >> z;
+					v.push_back(z);
+				}
 			}
 			return *this;
 		}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "utils/verify.h"
+
+#define MAX_POLL_EVENTS 256		// maximum events returned by a single wait
+
+// edge-triggered epoll wrapper, one per event loop
+class PollMgr {
+	int epfd_;
+	struct epoll_event evs_[MAX_POLL_EVENTS];
+
+	void ctl(int op, int fd, bool wr) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		if (wr) ev.events |= EPOLLOUT;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd_, op, fd, &ev) < 0)
+			printf("PollMgr::ctl(op %d, fd %d) failure, errno = %d\n", op, fd, errno);
+	}
+
+public:
+	PollMgr() {
+		epfd_ = epoll_create1(EPOLL_CLOEXEC);
+		VERIFY(epfd_ >= 0);
+	}
+
+	~PollMgr() { close(epfd_); }
+
+	// start watching fd, write interest only if wr
+	void add(int fd, bool wr = false) { ctl(EPOLL_CTL_ADD, fd, wr); }
+
+	// arm or disarm write interest of fd
+	void mod(int fd, bool wr) { ctl(EPOLL_CTL_MOD, fd, wr); }
+
+	// stop watching fd
+	void del(int fd) {
+		if (epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, NULL) < 0)
+			printf("PollMgr::del(fd %d) failure, errno = %d\n", fd, errno);
+	}
+
+	// wait for ready fds, to_ms < 0 means wait forever
+	int wait(int to_ms) {
+		return epoll_wait(epfd_, evs_, MAX_POLL_EVENTS, to_ms);
+	}
+
+	// accessors of the i-th ready event of last wait
+	int fd(int i) { return evs_[i].data.fd; }
+	bool readable(int i) {
+		return evs_[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP);
+	}
+	bool writable(int i) {
+		return evs_[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP);
+	}
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdint.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "common.hpp"
+#include "utils/verify.h"
+
+#define PROC_DENSE_SZ 4096		// procs below this are indexed directly
+
+// signature of a handler int f(A1 a1, ..., An an, R &r).
+// the args are decoded into a tuple of their decayed types
+template <class F>
+struct fn_traits : fn_traits<decltype(&F::operator())> {};	// lambdas and functors
+
+template <class Ret, class... A>
+struct fn_traits<Ret (*)(A...)> {
+	static const size_t nargs = sizeof...(A) - 1;
+	typedef std::tuple<std::decay_t<A>...> all;
+	typedef std::tuple_element_t<nargs, all> reply;
+	template <size_t... I>
+	static std::tuple<std::tuple_element_t<I, all>...> args_of(std::index_sequence<I...>);
+	typedef decltype(args_of(std::make_index_sequence<nargs>())) args;
+
+	static_assert(sizeof...(A) >= 1, "a handler takes its reply as the last arg");
+	static_assert(std::is_lvalue_reference<std::tuple_element_t<nargs, std::tuple<A...>>>::value,
+			"the reply of a handler must be passed by non-const reference");
+};
+
+template <class Ret, class... A>
+struct fn_traits<Ret (A...)> : fn_traits<Ret (*)(A...)> {};
+
+template <class Ret, class C, class... A>
+struct fn_traits<Ret (C::*)(A...)> : fn_traits<Ret (*)(A...)> {};
+
+template <class Ret, class C, class... A>
+struct fn_traits<Ret (C::*)(A...) const> : fn_traits<Ret (*)(A...)> {};
+
+// a member function bound to its object
+template <class S, class M>
+struct bound_method {
+	S *sob;
+	M meth;
+	template <class... A>
+	int operator()(A &&... a) { return (sob->*meth)(std::forward<A>(a)...); }
+};
+
+// a type-erased handler, one indirect call and no virtual dispatch
+struct proc_entry {
+	int (*fn)(void *obj, unmarshall &args, marshall &ret);
+	void *obj;					// the callable, owned by the table
+	void (*del)(void *obj);
+};
+
+// decode the args of Tr in place, call f with them moved in and marshall the reply
+template <class Tr, class Fn, size_t... I>
+inline int invoke_handler(Fn &f, unmarshall &args, marshall &ret, std::index_sequence<I...>) {
+	typename Tr::args a;
+	(void)(args >> ... >> std::get<I>(a));
+	if(!args.okdone())
+		return rpc_const::unmarshal_args_failure;
+	typename Tr::reply r;
+	int b = f(std::move(std::get<I>(a))..., r);
+	ret.reserve(wire_size(r));
+	ret << r;
+	return b;
+}
+
+template <class Tr, class Fn>
+int handler_thunk(void *obj, unmarshall &args, marshall &ret) {
+	return invoke_handler<Tr>(*(Fn *)obj, args, ret, std::make_index_sequence<Tr::nargs>());
+}
+
+template <class Fn>
+void handler_del(void *obj) { delete (Fn *)obj; }
+
+// handlers indexed by proc. small procs go to a flat array, the others to
+// a perfect hash rebuilt on every insert, which only happens before start.
+// lookups never lock or allocate. E is a type-erased entry like proc_entry
+template <class E>
+class proc_table {
+	std::vector<E> dense_;		// indexed by proc
+	std::vector<unsigned int> keys_;	// sparse procs by slot of the perfect hash, 0 if unused
+	std::vector<E> vals_;
+	uint32_t seed_;
+	int bits_;
+
+	size_t slot(unsigned int proc) const {
+		return bits_ == 0 ? 0 : (uint32_t)(proc * seed_) >> (32 - bits_);
+	}
+
+	// find a seed that maps every sparse proc to its own slot
+	void rehash(std::vector<std::pair<unsigned int, E>> &all) {
+		uint32_t x = 0x9e3779b9;
+		for (bits_ = 0; ((size_t)1 << bits_) < 2 * all.size(); bits_++) {}
+		while (1) {
+			for (int tries = 0; tries < 64; tries++) {
+				// odd multipliers from a xorshift sequence
+				x ^= x << 13;
+				x ^= x >> 17;
+				x ^= x << 5;
+				seed_ = x | 1;
+				size_t sz = (size_t)1 << bits_;
+				keys_.assign(sz, 0);
+				vals_.assign(sz, E{NULL, NULL, NULL});
+				bool ok = true;
+				for (auto &&kv : all) {
+					size_t s = slot(kv.first);
+					if (keys_[s]) {ok = false; break;}
+					keys_[s] = kv.first;
+					vals_[s] = kv.second;
+				}
+				if (ok) return;
+			}
+			VERIFY(bits_ < 32);
+			bits_++;
+		}
+	}
+
+public:
+	proc_table(): dense_(PROC_DENSE_SZ, E{NULL, NULL, NULL}),
+		keys_(1, 0), vals_(1, E{NULL, NULL, NULL}),
+		seed_(1), bits_(0) {}
+
+	~proc_table() {
+		for (auto &&e : dense_)
+			if (e.fn) e.del(e.obj);
+		for (size_t i = 0; i < vals_.size(); i++)
+			if (keys_[i]) vals_[i].del(vals_[i].obj);
+	}
+
+	bool has(unsigned int proc) const { return find(proc) != NULL; }
+
+	void insert(unsigned int proc, E e) {
+		VERIFY(!has(proc));
+		if (proc < PROC_DENSE_SZ) {
+			dense_[proc] = e;
+			return;
+		}
+		std::vector<std::pair<unsigned int, E>> all;
+		for (size_t i = 0; i < vals_.size(); i++)
+			if (keys_[i]) all.push_back(std::make_pair(keys_[i], vals_[i]));
+		all.push_back(std::make_pair(proc, e));
+		rehash(all);
+	}
+
+	// the handler of proc, NULL if there is none
+	const E *find(unsigned int proc) const {
+		if (proc < PROC_DENSE_SZ)
+			return dense_[proc].fn ? &dense_[proc] : NULL;
+		size_t s = slot(proc);
+		return keys_[s] == proc ? &vals_[s] : NULL;
+	}
+};
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <pthread.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#include "marshall.hpp"
+#include "utils/verify.h"
+#include "utils/slock.h"
+
+#define REPLY_CACHE_WINDOW 4096				// rids kept per client at most
+#define REPLY_CACHE_CLIENT_BYTES (16 << 20)	// reply bytes kept per client at most
+#define REPLY_CACHE_BYTES (256 << 20)		// reply bytes kept over all clients at most
+#define REPLY_CACHE_SHARDS 16				// locks over the clients, must be a power of 2
+
+// at-most-once state of a server: per client, the rids whose handler has
+// run or is running, with the replies of those done. each request carries
+// the rid up to which its client is done (xid_rep), and replies at or below
+// it are dropped, so a client holds no more than its calls in flight.
+// only a request sent with cached set, i.e. one its client may retransmit,
+// has its reply kept, others are tracked while they run.
+// a retransmitted request is answered from here, and one at or below the
+// window gets atmostonce_failure, as its handler may have run but its reply
+// is gone. so does one whose reply was dropped for space. a cancelled rid
+// is kept the same way, so a request that comes after its cancel is
+// dropped and a running handler can see it.
+class reply_cache {
+public:
+	enum state {
+		NEW,		// first seen, run it and call done
+		INPROGRESS,	// its handler is running, the first reply goes out
+		DONE,		// reply copied from the cache
+		FORGOTTEN,	// at or below the window
+		CANCELLED,	// cancelled before it came, drop it
+		GONE,		// its client is forgotten, drop it
+	};
+
+private:
+	struct entry {
+		bool started;		// the request has come
+		bool cancelled;
+		bool done;
+		bool lost;			// done, but the reply was dropped for space
+		int result;
+		std::string body;	// reply after the header, without a blob
+		bool blob;			// if the reply ends with a blob
+		rpc_file file;		// a dup of the blob fd
+
+		entry(): started(true), cancelled(false), done(false), lost(false), result(0), blob(false) {}
+	};
+
+	struct window {
+		unsigned int acked;		// every rid up to it is forgotten
+		size_t bytes;			// of the replies kept
+		std::map<unsigned int, entry> es;
+
+		window(): acked(0), bytes(0) {}
+	};
+
+	struct shard {
+		pthread_mutex_t m;
+		std::unordered_map<unsigned int, window> clts;
+	};
+
+	shard shards_[REPLY_CACHE_SHARDS];
+	std::atomic<size_t> bytes_;		// of the replies kept by all clients
+
+	shard &shard_of(unsigned int clt) { return shards_[clt & (REPLY_CACHE_SHARDS - 1)]; }
+
+	static void drop(entry &e) {
+		if (e.file.fd >= 0) close(e.file.fd);
+		e.file.fd = -1;
+	}
+
+	// drop the reply of e, kept in w
+	void release(window &w, entry &e) {
+		drop(e);
+		w.bytes -= e.body.size();
+		bytes_ -= e.body.size();
+		std::string().swap(e.body);
+	}
+
+	// forget every rid up to acked
+	void trim(window &w, unsigned int acked) {
+		auto end = w.es.upper_bound(acked);
+		for (auto it = w.es.begin(); it != end; it++) release(w, it->second);
+		w.es.erase(w.es.begin(), end);
+		w.acked = acked;
+	}
+
+	// drop the oldest reply kept in w, false if there is none
+	bool evict(window &w) {
+		for (auto &&e : w.es) {
+			if (!e.second.done || e.second.lost) continue;
+			release(w, e.second);
+			e.second.lost = true;
+			return true;
+		}
+		return false;
+	}
+
+public:
+	reply_cache(): bytes_(0) {
+		for (auto &&s : shards_)
+			VERIFY(pthread_mutex_init(&s.m, 0) == 0);
+	}
+
+	~reply_cache() {
+		for (auto &&s : shards_) {
+			for (auto &&c : s.clts)
+				for (auto &&e : c.second.es) drop(e.second);
+			VERIFY(pthread_mutex_destroy(&s.m) == 0);
+		}
+	}
+
+	// look up the request of h and trim the window of its client.
+	// for DONE the cached reply is appended to rep and its result put in result
+	state check(const req_header &h, marshall &rep, int *result) {
+		std::string body;
+		bool blob;
+		rpc_file f;
+		{
+			shard &s = shard_of(h.clt_id);
+			ScopedLock sl(&s.m);
+			auto c = s.clts.find(h.clt_id);
+			if (c == s.clts.end()) return GONE;
+			window &w = c->second;
+			unsigned int rid = h.rid, acked = h.xid_rep;
+			if (acked > w.acked) trim(w, acked);
+			if (rid <= w.acked) return FORGOTTEN;
+
+			auto res = w.es.try_emplace(rid);
+			if (res.second) {
+				// a client that never acks still has a bounded window. the rids
+				// trimmed are forgotten, so even one still running never runs again
+				while (w.es.size() > REPLY_CACHE_WINDOW)
+					trim(w, w.es.begin()->first);
+				return NEW;
+			}
+			entry &e = res.first->second;
+			if (!e.started) return CANCELLED;
+			if (!e.done) return INPROGRESS;
+			if (e.lost) return FORGOTTEN;
+			*result = e.result;
+			body = e.body;
+			blob = e.blob;
+			if (blob) f = rpc_file(dup(e.file.fd), e.file.off, e.file.len);
+		}
+		rep.rawbytes(body.data(), body.size());
+		if (blob) {
+			if (f.fd < 0) printf("reply_cache::check dup failure, errno = %d\n", errno);
+			rep << f;
+		}
+		return DONE;
+	}
+
+	// keep the reply of a NEW request, unless the client is done with it
+	// already or it is not cached
+	void done(const req_header &h, int result, marshall &rep) {
+		if (!h.cached) {
+			// the client never sends it again, only a cancel may still come
+			shard &s = shard_of(h.clt_id);
+			ScopedLock sl(&s.m);
+			auto w = s.clts.find(h.clt_id);
+			if (w != s.clts.end()) w->second.es.erase(h.rid);
+			return;
+		}
+
+		entry r;
+		r.done = true;
+		r.result = result;
+		size_t n = rep.size() - RPC_HEADER_SZ;
+		if (rep.has_file()) n -= 4;		// the blob length is written again by the rpc_file
+		// a reply over the budget of its client is never kept, so not copied either
+		bool fits = n <= REPLY_CACHE_CLIENT_BYTES;
+		if (fits) {
+			if (rep.has_file()) {
+				const rpc_file &f = rep.file();
+				r.blob = true;
+				r.file = rpc_file(dup(f.fd), f.off, f.len);
+			}
+			r.body.assign(rep.cstr() + RPC_HEADER_SZ, n);
+		}
+
+		{
+			shard &s = shard_of(h.clt_id);
+			ScopedLock sl(&s.m);
+			auto w = s.clts.find(h.clt_id);
+			if (w != s.clts.end()) {
+				auto res = w->second.es.find(h.rid);
+				if (res != w->second.es.end() && !res->second.done) {
+					window &wd = w->second;
+					r.cancelled = res->second.cancelled;
+					// older replies of the client make room, those of
+					// others are not touched, this one is dropped instead
+					while (fits && wd.bytes + n > REPLY_CACHE_CLIENT_BYTES && evict(wd)) {}
+					fits = fits && wd.bytes + n <= REPLY_CACHE_CLIENT_BYTES;
+					if (fits && bytes_.fetch_add(n) + n > REPLY_CACHE_BYTES) {
+						bytes_ -= n;
+						fits = false;
+					}
+					if (fits) {
+						wd.bytes += n;
+					} else {
+						drop(r);
+						std::string().swap(r.body);
+						r.lost = true;
+					}
+					std::swap(res->second, r);
+				}
+			}
+		}
+		drop(r);
+	}
+
+	// cancel rid of clt, whether its request has come or not
+	void cancel(unsigned int clt, unsigned int rid) {
+		shard &s = shard_of(clt);
+		ScopedLock sl(&s.m);
+		auto c = s.clts.find(clt);
+		if (c == s.clts.end()) return;
+		window &w = c->second;
+		if (rid <= w.acked) return;
+		auto res = w.es.try_emplace(rid);
+		entry &e = res.first->second;
+		if (res.second) e.started = false;
+		if (!e.done) e.cancelled = true;
+	}
+
+	// if the client has given up on rid: cancelled it or is done with it
+	bool gone(unsigned int clt, unsigned int rid) {
+		shard &s = shard_of(clt);
+		ScopedLock sl(&s.m);
+		auto w = s.clts.find(clt);
+		if (w == s.clts.end() || rid <= w->second.acked) return true;
+		auto res = w->second.es.find(rid);
+		return res == w->second.es.end() || res->second.cancelled;
+	}
+
+	// start a window for a client on its first request. only open clients
+	// are cached, so a request left over from a forgotten one is dropped
+	void open(unsigned int clt) {
+		shard &s = shard_of(clt);
+		ScopedLock sl(&s.m);
+		s.clts.try_emplace(clt);
+	}
+
+	// drop the state of a client that is gone
+	void forget(unsigned int clt) {
+		shard &s = shard_of(clt);
+		ScopedLock sl(&s.m);
+		auto w = s.clts.find(clt);
+		if (w == s.clts.end()) return;
+		for (auto &&e : w->second.es) release(w->second, e.second);
+		s.clts.erase(w);
+	}
+};
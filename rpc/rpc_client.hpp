@@ -1,23 +1,34 @@
 #pragma once
 
 #include <list>
+#include <set>
+#include <limits.h>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
 #include <netdb.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "common.hpp"
 #include "connection.hpp"
+#include "pollmgr.hpp"
+#include "call_table.hpp"
+#include "stream.hpp"
 #include "utils/timer.h"
+#include "utils/timer_wheel.h"
+#include "utils/mpsc_queue.h"
 
 #define MAX_TIMEOUT rpc_const::to_max
 
 static void *poll_thread(void *arg);
-static int cmp_timespec(const struct timespec &a, const struct timespec &b);
-static void add_timespec(const struct timespec &a, int b, struct timespec *result);
-static int diff_timespec(const struct timespec &end, const struct timespec &start);
 
-// manages per RPC info
-struct caller {
+// manages per RPC info, the timer is its deadline or next retransmit
+struct caller : timer_node {
     caller(unsigned int id, unmarshall *xun)
-    : rid(id), un(xun), done(false) {
+    : rid(id), un(xun), done(false), ddl(0), rto(0) {
         VERIFY(pthread_mutex_init(&m,0) == 0);
         VERIFY(pthread_cond_init(&c, 0) == 0);
     }
@@ -33,27 +44,93 @@ struct caller {
     bool done;
     pthread_mutex_t m;
     pthread_cond_t c;
+    uint64_t ddl;           // deadline in usec
+    std::string req;        // copy to retransmit, empty if not
+    uint64_t rto;           // usec until the next retransmit
+
+    // only for async calls
+    std::function<void(int, unmarshall &)> cb;  // completion callback
+};
+
+// independent calls sent to the server in one frame, see RPCC::call_batch.
+// add the calls, issue the batch once, then read each reply with get
+class rpc_batch {
+    friend class RPCC;
+    marshall req_;                      // n, then (proc, args) entries
+    unsigned int n_;
+    unmarshall rep_;                    // owns the reply frame
+    std::vector<int> results_;
+    std::vector<std::string_view> replies_;     // point into rep_
+
+public:
+    rpc_batch(): n_(0) {
+        req_ << 0u;     // n is filled in when sent
+    }
+
+    // queue proc(args...), its index is size() before the call
+    template<class... Args>
+    void add(unsigned int proc, const Args&... args) {
+        req_.reserve(8 + wire_size(args...));
+        req_ << proc;
+        int at = req_.size();
+        req_ << 0u;
+        (void)(req_ << ... << args);
+        req_.patch(at, req_.size() - at - 4);
+        n_++;
+    }
+
+    size_t size() { return n_; }
+
+    // result of the i-th call, valid once the batch is done
+    int result(size_t i) { return results_[i]; }
+
+    // unmarshall the reply of the i-th call into r, return its result
+    template<class R>
+    int get(size_t i, R &r) {
+        if (results_[i] < 0) return results_[i];
+        unmarshall u((char *)replies_[i].data(), replies_[i].size());
+        u >> r;
+        if (!u.okdone()) return rpc_const::unmarshal_reply_failure;
+        return results_[i];
+    }
 };
 
 // RPC client endpoint
 class RPCC {
+    friend class rpc_stream_end;
 private:
     sockaddr_in dst_;       // server address
-	pthread_t poll_th_;     // polling thread
-    unsigned int rid_;		// next request id
+	pthread_t poll_th_;     // polling thread, the only writer of ch
+    std::atomic<unsigned int> rid_;		// next request id
     unsigned int cid_;		// client id
     unsigned int sid_;		// server id
     bool bind_done_;        // if already bind with server
     Connection *ch;         // connection with server
-    std::map<int, caller *> calls_;     // RPC requests
+    call_table<caller> calls_;          // RPC requests
+    timer_wheel timers_;    // timers of the callers in calls_
+    int tfd_;               // timerfd of the first timer, wakes up the polling thread
+    uint64_t armed_;        // usec tfd_ is set to, UINT64_MAX if not
+
+    // requests are pushed by any thread and written by the polling thread
+    mpsc_queue<buffer> sendq_;
+    int evfd_;              // wakes up the polling thread
+    PollMgr poll_;
+    bool rd_more_;          // ch may have unread msgs left after MAX_MSG_CNT
+    std::atomic<bool> stop_;
+    std::atomic<uint64_t> stream_ids_;  // next stream id
+    std::atomic<unsigned int> xid_rep_; // done with every rid up to this one, see reply_cache
+    std::set<unsigned int> xid_done_;   // rids done above xid_rep_
+    uint64_t stray_;        // replies to rids never sent, polling thread only
+    TO retrans_;            // first retransmit of a call in msec, 0 if off
 
 	// mutexs
-	pthread_mutex_t m_; 		// protect meta info(calls_)
+	pthread_mutex_t m_; 		// protect timers_ and armed_
 	pthread_mutex_t chan_m_;	// protect channel
+	pthread_mutex_t xid_m_;		// protect xid_done_
 
-    int call1(unsigned int proc, marshall &req, unmarshall &rep, TO to) {
-        // printf("---RPCC::call1(proc = %x, to = %d)---\n", proc, to);
-
+    // register caller and send its request, return its rid or < 0 on failure.
+    // ca may be finished by the polling thread once its timer is set
+    int start_call(unsigned int proc, marshall &req, caller *ca) {
         // check bind
         if((proc != rpc_const::bind && !bind_done_) ||
                 (proc == rpc_const::bind && bind_done_)){
@@ -61,54 +138,221 @@ private:
             return rpc_const::bind_failure;
         }
 
-        // update meta info
-        caller ca(0, &rep);
-        ca.rid = rid_++;
-        calls_[ca.rid] = &ca;
-        struct timespec now, nextDDL, finalDDL; 
-        clock_gettime(CLOCK_REALTIME, &now);
-        add_timespec(now, to, &finalDDL);
-
-        // pack header
-        req_header h(ca.rid, proc, cid_, sid_);
+        // update meta info, rids stay positive so they can be returned
+        int rid = rid_++ & 0x7fffffff;
+        ca->rid = rid;
+        calls_.insert(rid, ca);
+
+        // pack header, the server sheds the call once its budget is spent.
+        // stream frames have their own seq and are not deduplicated, other
+        // calls are retransmitted if set_retransmit is on, and only then
+        // does the server keep their replies
+        uint64_t now = timer::get_usec();
+        bool resend = retrans_ > 0 && proc != rpc_const::stream;
+        req_header h(rid, proc, cid_, sid_, xid_rep_, budget(ca->ddl, now));
+        h.cached = resend;
         req.pack_req_header(h);
 
-        // send msg to dst server
-        VERIFY(ch);
-        ch->send(req.cstr(), req.size());
-        // printf("RPCC::call1 [CLT %u] just sent req rid %u(proc %x)\n", cid_, ca.rid, proc); 
-
-        // wait for reply
-        while (!ca.done) {
-            // set timeout
-            clock_gettime(CLOCK_REALTIME, &now);
-            add_timespec(now, rpc_const::to_min, &nextDDL); 
-            
-            if(cmp_timespec(nextDDL, finalDDL) > 0){
-                // printf("RPCC:call1: wait for reply\n");
-                if(pthread_cond_timedwait(&ca.c, &ca.m, &finalDDL) == ETIMEDOUT){
-                    printf("RPCC::call1: timeout\n");
-                    return rpc_const::timeout_failure;
-                }
-            } else {
-                // printf("RPCC:call1: wait for reply\n");
-                pthread_cond_timedwait(&ca.c, &ca.m, &nextDDL);
-            }
+        char *b;
+        int sz;
+        req.take_buf(&b, &sz);
+
+        uint64_t first = ca->ddl;
+        if (resend) {
+            ca->req.assign(b, sz);
+            ca->rto = (uint64_t)retrans_ * 1000;
+            first = std::min(first, now + ca->rto);
+        }
+        {
+            ScopedLock ml(&m_);
+            timers_.add(ca, first);
+            if (first < armed_) arm(first);
         }
+        push(buffer(b, sz));
+        // printf("RPCC::call1 [CLT %u] just queued req rid %u(proc %x)\n", cid_, rid, proc); 
+        return rid;
+    }
 
-        // clear caller
-        ScopedLock ml(&m_);
-        calls_.erase(ca.rid);
+    // queue msg for the polling thread, only the first producer wakes it
+    void push(buffer msg) {
+        ch->prepare(msg);   // compress and seal here rather than on the poll thread
+        if (sendq_.push(msg)) wake();
+    }
+
+    // usec from now to ddl as sent in a header, at least 1 as 0 means none
+    static unsigned int budget(uint64_t ddl, uint64_t now) {
+        if (ddl <= now) return 1;
+        return ddl - now < UINT_MAX ? ddl - now : UINT_MAX;
+    }
+
+    // a copy of the kept request of ca to send again, with the same rid
+    // and the budget left. the server runs it at most once
+    buffer retransmit(caller *ca, uint64_t now) {
+        const std::string &req = ca->req;
+        char *b = buf_alloc(req.size());
+        memcpy(b, req.data(), req.size());
+        uint32_t left = htonl(budget(ca->ddl, now));
+        memcpy(b + RPC_BUDGET_OFF, &left, sizeof(left));
+        return buffer(b, req.size());
+    }
+
+    // ask the server to drop or flag rid, the frame gets no reply
+    void send_cancel(unsigned int rid) {
+        marshall m;
+        m.pack_req_header(req_header(rid, rpc_const::cancel, cid_, sid_, xid_rep_));
+        char *b;
+        int sz;
+        m.take_buf(&b, &sz);
+        push(buffer(b, sz));
+    }
+
+    // wake up the polling thread at usec us, UINT64_MAX for never
+    void arm(uint64_t us) {
+        struct itimerspec its = {};
+        if (us != UINT64_MAX) {
+            its.it_value.tv_sec = us / 1000000;
+            its.it_value.tv_nsec = us % 1000000 * 1000;
+        }
+        if (timerfd_settime(tfd_, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+            printf("RPCC::arm timerfd failure, errno = %d\n", errno);
+        armed_ = us;
+    }
+
+    // the caller of rid is finished, so the server may drop its reply
+    void rid_done(unsigned int rid) {
+        ScopedLock xl(&xid_m_);
+        xid_done_.insert(rid);
+        unsigned int x = xid_rep_;
+        auto it = xid_done_.begin();
+        while (it != xid_done_.end() && *it == x + 1) {
+            x++;
+            it = xid_done_.erase(it);
+        }
+        xid_rep_ = x;
+    }
+
+    // if the caller of rid is finished
+    bool rid_finished(unsigned int rid) {
+        ScopedLock xl(&xid_m_);
+        return rid <= xid_rep_ || xid_done_.count(rid);
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        if (write(evfd_, &one, sizeof(one)) != sizeof(one))
+            printf("RPCC::wake eventfd failure, errno = %d\n", errno);
+    }
+
+    // move queued requests to ch and write as much as possible
+    void flush_sendq() {
+        uint64_t cnt;
+        while (read(evfd_, &cnt, sizeof(cnt)) > 0) {}
+        std::vector<buffer> bufs;
+        sendq_.pop_all(bufs);
+        for (auto &&b : bufs) ch->add_wbuf(b);
+        ch->write_cb();
+    }
+
+    // arm write interest only while ch has queued msgs
+    void update_interest() {
+        if (ch->is_dead()) return;
+        bool wr = !ch->empty_wbuf();
+        if (wr == ch->wr_armed) return;
+        poll_.mod(ch->channo(), wr);
+        ch->wr_armed = wr;
+    }
+
+    int call1(unsigned int proc, marshall &req, unmarshall &rep, uint64_t to_us) {
+        // printf("---RPCC::call1(proc = %x, to = %lu us)---\n", proc, to_us);
+        caller ca(0, &rep);
+        ca.ddl = timer::get_usec() + to_us;
+        int ret = start_call(proc, req, &ca);
+        if (ret < 0) return ret;
+
+        // wait for reply, the polling thread times the call out
+        ScopedLock cl(&ca.m);
+        while (!ca.done)
+            VERIFY(pthread_cond_wait(&ca.c, &ca.m) == 0);
 
         // printf("RPCC::call1: reply received\n");
         return ca.result;
     }
 
+    // issue an RPC whose reply is handed to fn(ret, unmarshall) on the polling thread
+    int call_async1(unsigned int proc, marshall &req, 
+            std::function<void(int, unmarshall &)> fn, uint64_t to_us) {
+        caller *ca = new caller(0, NULL);
+        ca->cb = fn;
+        ca->ddl = timer::get_usec() + to_us;
+        int ret = start_call(proc, req, ca);
+        if (ret < 0) delete ca;
+        return ret;
+    }
+
+    // hand the reply to a caller taken out of calls_,
+    // on the polling thread unless the call is cancelled
+    void finish(caller *ca, int result, unmarshall &rep) {
+        {
+            ScopedLock ml(&m_);
+            timers_.del(ca);
+        }
+        rid_done(ca->rid);
+
+        if (!ca->cb) {
+            // unmarshall result and update caller
+            ScopedLock cl(&ca->m);
+            ca->un->take_in(rep);
+            ca->result = result;
+            ca->done = 1;
+
+            // finish the caller
+            VERIFY(pthread_cond_broadcast(&ca->c) == 0);
+            return;
+        }
+
+        // async caller, complete it on this thread
+        ca->cb(result, rep);
+        delete ca;
+    }
+
+    // time out or retransmit the calls whose timer is due
+    void expire() {
+        std::vector<unsigned int> due;
+        std::vector<buffer> resend;
+        uint64_t now = timer::get_usec();
+        {
+            // a caller may be finished by cancel once m_ is released
+            ScopedLock ml(&m_);
+            timers_.advance(now, [&](timer_node *n) {
+                caller *ca = static_cast<caller *>(n);
+                if (now >= ca->ddl) {
+                    due.push_back(ca->rid);
+                    return;
+                }
+                // back off until the deadline
+                ca->rto = std::min(ca->rto * 2, (uint64_t)rpc_const::to_max * 1000);
+                timers_.add(ca, std::min(ca->ddl, now + ca->rto));
+                resend.push_back(retransmit(ca, now));
+            });
+            uint64_t first = timers_.next_usec();
+            if (first != armed_) arm(first);
+        }
+
+        for (auto &&b : resend) push(b);
+        for (auto &&rid : due) {
+            caller *ca = calls_.take(rid);
+            if (!ca) continue;
+            unmarshall un;
+            printf("RPCC::expire: rid %u timeout\n", rid);
+            finish(ca, rpc_const::timeout_failure, un);
+        }
+    }
+
     // process single msg from server
     void process_msg(Connection *c, char *buf, size_t sz) {
         // printf("---RPCC::process_msg(buf = %p, sz = %lu)---\n", buf, sz);
-        // unpack header
-        unmarshall rep(buf, sz);
+        // unpack header, rep owns buf unless it is handed to a sync caller
+        unmarshall rep(buf, sz, true);
         reply_header h;
         rep.unpack_reply_header(&h);
 
@@ -117,33 +361,28 @@ private:
             return;
         }
 
-        ScopedLock ml(&m_);
-        if(calls_.find(h.rid) == calls_.end()){
-            printf("RPCC::process_msg rid %d no pending request\n", h.rid);
+        // whoever takes the caller out of calls_ finishes it
+        caller *ca = calls_.take(h.rid);
+        if(!ca){
+            // a retransmitted call gets a reply per copy that reached the
+            // server, and one that timed out may still get its reply late
+            if (rid_finished(h.rid)) return;
+            uint64_t n = ++stray_;
+            if (Connection::log_bad(n))
+                printf("RPCC::process_msg rid %d no pending request, %lu so far\n", h.rid, (unsigned long)n);
             return;
         }
-        caller *ca = calls_[h.rid];
-
-        // unmarshall result and update caller
-        ScopedLock cl(&ca->m);
-        if(!ca->done){
-            ca->un->take_in(rep);
-            ca->result = h.result;
-            if(ca->result < 0)
-                printf("RPCC::process_msg: RPC reply error for rid %d (stat = %d)\n", h.rid, ca->result);
-            ca->done = 1;
-        }
 
-        // finish the caller
-        VERIFY(pthread_cond_broadcast(&ca->c) == 0);
-
-        return;
+        if(h.result < 0)
+            printf("RPCC::process_msg: RPC reply error for rid %d (stat = %d)\n", h.rid, h.result);
+        finish(ca, h.result, rep);
     }
 
 public:
 
     RPCC(const char *host, unsigned int port)
-        :rid_(1), sid_(0), bind_done_(false) {
+        :rid_(1), sid_(0), bind_done_(false), timers_(timer::get_usec()), armed_(UINT64_MAX),
+        rd_more_(false), stop_(false), stream_ids_(1), xid_rep_(0), stray_(0), retrans_(0) {
         // parse address
         in_addr_t a;
         bzero(&dst_, sizeof(dst_));
@@ -164,6 +403,7 @@ public:
         // initialize mutex
         VERIFY(pthread_mutex_init(&m_, 0) == 0);
         VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
+        VERIFY(pthread_mutex_init(&xid_m_, 0) == 0);
 
         // random client id
         struct timespec ts;
@@ -177,6 +417,13 @@ public:
             printf("RPCC::RPCC fail to connect with remote addr\n");
             exit(0);
         }
+        evfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        VERIFY(evfd_ >= 0);
+        poll_.add(evfd_);
+        tfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        VERIFY(tfd_ >= 0);
+        poll_.add(tfd_);
+        poll_.add(ch->channo());
 
         // create polling thread
         int err = pthread_create(&poll_th_, NULL, poll_thread, this);
@@ -187,60 +434,145 @@ public:
     }
 
     ~RPCC() {
-        if (ch) ch->closeCh();
+        // stop the polling thread before tearing down the connection
+        stop_ = true;
+        wake();
+        VERIFY(pthread_join(poll_th_, NULL) == 0);
+
+        // fail calls still pending
+        calls_.drain([](caller *ca) {
+            unmarshall un;
+            if (!ca->cb) {
+                ScopedLock cl(&ca->m);
+                ca->result = rpc_const::timeout_failure;
+                ca->done = 1;
+                VERIFY(pthread_cond_broadcast(&ca->c) == 0);
+                return;
+            }
+            ca->cb(rpc_const::timeout_failure, un);
+            delete ca;
+        });
+        std::vector<buffer> bufs;
+        sendq_.pop_all(bufs);
+        for (auto &&b : bufs) b.clear();
+
+        if (ch) {
+            ch->closeCh();
+            ch->decref();
+        }
+        close(evfd_);
+        close(tfd_);
         VERIFY(pthread_mutex_destroy(&m_) == 0);
         VERIFY(pthread_mutex_destroy(&chan_m_) == 0);
+        VERIFY(pthread_mutex_destroy(&xid_m_) == 0);
     }
 
 	unsigned int id() { return cid_; }
 
-    // a sample RPC call to bind with server
+    // a sample RPC call to bind with server.
+    // after set_checksum the bind request is sealed, and a server that
+    // checks it seals its replies too, otherwise checksums are turned off.
+    // after set_compression the request tells the server compressed msgs
+    // are welcome, and its reply tells whether it takes them too
     int bind(TO to = rpc_const::to_max) {
         int sid;
         int ret = call(rpc_const::bind, sid, to, 0);
         if(ret == 0){
             bind_done_ = true;      // must bind first
             sid_ = sid;
+            if (ch->checksummed() && !ch->peer_checksummed()) {
+                printf("RPCC::bind %s does not checksum, going without\n", inet_ntoa(dst_.sin_addr));
+                ch->checksum(false);
+            }
+            if (ch->compressing() && !ch->peer_compresses())
+                printf("RPCC::bind %s does not compress, going without\n", inet_ntoa(dst_.sin_addr));
         } else {
             printf("RPCC::bind %s failed %d\n", inet_ntoa(dst_.sin_addr), ret);
         }
         return ret;
     }
 
-    // constantly do poll and push
-    void poll_and_push() {
-        // printf("---RPCC::poll_and_push--- on fd_set: (%d) \n", ch->channo());
+    // end every msg with a CRC32C checked on receipt, negotiated by bind,
+    // so it must be called before. the trailer costs 4 bytes per msg
+    void set_checksum() { ch->checksum(true); }
+
+    // compress msgs of at least min bytes both ways, negotiated by bind,
+    // so it must be called before. a msg is sent as is if it does not shrink
+    void set_compression(size_t min = COMPRESS_MIN_SZ) { ch->compression(min); }
+
+    // send requests of at least min bytes with MSG_ZEROCOPY, see Connection::zerocopy
+    bool set_zerocopy(size_t min = ZEROCOPY_MIN_SZ) { return ch->zerocopy(min); }
+
+    // give up on call rid at once: it fails with cancel_failure, on this
+    // thread for an async call, and the server drops it if it has not
+    // started yet or lets its handler see it, see rpc_call_ctx::cancelled.
+    // return false if the call was over already
+    bool cancel(unsigned int rid) {
+        caller *ca = calls_.take(rid);
+        if (!ca) return false;
+        // queued before finish acks rid, so the server gets the cancel first
+        send_cancel(rid);
+        unmarshall un;
+        finish(ca, rpc_const::cancel_failure, un);
+        return true;
+    }
+
+    // resend a call with the same rid if no reply came after first msec,
+    // then after twice as long and so on, 0 turns it off. the server runs
+    // each rid at most once and answers a retransmit from its reply cache,
+    // so this is safe for calls that are not idempotent
+    void set_retransmit(TO first) { retrans_ = first; }
 
-        int fd_ = ch->channo();
-        fd_set rfds;
-        FD_SET(fd_, &rfds);
+    // constantly do poll and push, return false once the client is stopping
+    bool poll_and_push() {
+        // printf("---RPCC::poll_and_push--- on fd: (%d) \n", ch->channo());
 
-        int ret = select(fd_ + 1, &rfds, NULL, NULL, NULL);
+        // don't block if ch still has msgs to read, tfd_ wakes up for timers
+        int ret = poll_.wait(rd_more_ ? 0 : -1);
         // printf("RPCC::poll_and_push %d socket ready...\n", ret);
 
         if (ret < 0) {
             if (errno == EINTR) {
-                return;
+                return !stop_;      // a signal, wait again
             } else {
                 printf("RPCC::poll_and_push failure, errno = %d\n", errno);
                 VERIFY(0);
             }
         }
 
-        if (FD_ISSET(fd_, &rfds)) {ch->read_cb();}
-        // for each conn, process its rbuf queue
-        for (size_t i = 0; i < ch->rbuf_cnt(); i++) {
+        for (int i = 0; i < ret; i++) {
+            if (poll_.fd(i) == evfd_) {flush_sendq(); continue;}
+            if (poll_.fd(i) == tfd_) {
+                uint64_t cnt;
+                while (read(tfd_, &cnt, sizeof(cnt)) > 0) {}
+                continue;
+            }
+            if (poll_.writable(i)) ch->write_cb();
+            if (poll_.readable(i)) rd_more_ = true;
+        }
+        if (rd_more_) rd_more_ = ch->read_cb();
+        update_interest();
+
+        // process the rbuf queue
+        while (ch->rbuf_cnt() > 0) {
             buffer buf = ch->next_rbuf();
             VERIFY(buf.sz == buf.solong);
             process_msg(ch, buf.buf, buf.sz);
         }
+        expire();
+        return !stop_;
     }
 
 	// -----------rpc calls-----------
     template<class R> 
     int call_m(unsigned int proc, marshall &req, R & r, TO to)  {
+        return call_m_us(proc, req, r, (uint64_t)to * 1000);
+    }
+
+    template<class R> 
+    int call_m_us(unsigned int proc, marshall &req, R & r, uint64_t to_us)  {
         unmarshall u;
-        int intret = call1(proc, req, u, to);
+        int intret = call1(proc, req, u, to_us);
         if (intret < 0) return intret;
         u >> r;
         if(u.okdone() != true) {
@@ -255,55 +587,320 @@ public:
 
     template<class R, class... Args> 
     int call(unsigned int proc, R & r, TO to, const Args&... args) {
+        return call_us(proc, r, (uint64_t)to * 1000, args...);
+    }
+
+    // call with a timeout in usec, timers have a resolution of 64 usec
+    template<class R, class... Args> 
+    int call_us(unsigned int proc, R & r, uint64_t to_us, const Args&... args) {
+        marshall m(wire_size(args...));
+        (void)(m << ... << args);
+        return call_m_us(proc, m, r, to_us);
+    }
+
+    // issue proc without waiting, cb(ret, r) is run on the polling thread
+    // once the reply arrives or to expires, so it must not block on other RPCs.
+    // return the request id, or < 0 if the call cannot be issued
+    template<class R, class F, class... Args,
+        class = std::enable_if_t<std::is_invocable_v<F, int, R &>>> 
+    int call_async(unsigned int proc, F cb, TO to, const Args&... args) {
+        return call_async_us<R>(proc, cb, (uint64_t)to * 1000, args...);
+    }
+
+    // call_async with a timeout in usec
+    template<class R, class F, class... Args,
+        class = std::enable_if_t<std::is_invocable_v<F, int, R &>>> 
+    int call_async_us(unsigned int proc, F cb, uint64_t to_us, const Args&... args) {
+        marshall m(wire_size(args...));
+        (void)(m << ... << args);
+        return call_async1(proc, m, [cb, proc](int ret, unmarshall &u) {
+            R r;
+            if (ret >= 0) {
+                u >> r;
+                if (u.okdone() != true) {
+                    fprintf(stderr, "RPCC::call_async: failed to unmarshall the reply."
+                        "You are probably calling RPC 0x%x with wrong return "
+                        "type.\n", proc);
+                    ret = rpc_const::unmarshal_reply_failure;
+                }
+            }
+            cb(ret, r);
+        }, to_us);
+    }
+
+    // future flavour of call_async, r must outlive the returned future
+    template<class R, class... Args> 
+    std::future<int> call_async(unsigned int proc, R & r, TO to, const Args&... args) {
+        std::shared_ptr<std::promise<int>> p = std::make_shared<std::promise<int>>();
+        std::future<int> f = p->get_future();
+        int ret = call_async<R>(proc, [p, &r](int ret, R &rep) {
+            if (ret >= 0) r = std::move(rep);
+            p->set_value(ret);
+        }, to, args...);
+        if (ret < 0) p->set_value(ret);
+        return f;
+    }
+
+    // issue every call of b in one frame and wait for the one reply frame.
+    // return < 0 if the batch as a whole failed, otherwise the result
+    // of each call is in b
+    int call_batch(rpc_batch &b, TO to) {
+        b.req_.patch(RPC_HEADER_SZ, b.n_);
+        int ret = call1(rpc_const::batch, b.req_, b.rep_, (uint64_t)to * 1000);
+        if (ret < 0) return ret;
+
+        unsigned int n;
+        b.rep_ >> n;
+        for (unsigned int i = 0; i < n && b.rep_.ok(); i++) {
+            int result;
+            std::string_view rep;
+            b.rep_ >> result >> rep;
+            b.results_.push_back(result);
+            b.replies_.push_back(rep);
+        }
+        if (!b.rep_.okdone() || n != b.n_) {
+            fprintf(stderr, "RPCC::call_batch: failed to unmarshall the reply.\n");
+            return rpc_const::unmarshal_reply_failure;
+        }
+        return ret;
+    }
+};
+
+// cancels every async call added to it at once, e.g. the copies of a
+// hedged request that lost. meant for a group of calls, it must not
+// outlive the clients of its calls
+class rpc_cancel_token {
+    pthread_mutex_t m_;     // protect calls_ and cancelled_
+    std::vector<std::pair<RPCC *, unsigned int>> calls_;
+    bool cancelled_;
+
+public:
+    rpc_cancel_token(): cancelled_(false) {
+        VERIFY(pthread_mutex_init(&m_, 0) == 0);
+    }
+
+    ~rpc_cancel_token() {
+        VERIFY(pthread_mutex_destroy(&m_) == 0);
+    }
+
+    rpc_cancel_token(const rpc_cancel_token &) = delete;
+    rpc_cancel_token &operator=(const rpc_cancel_token &) = delete;
+
+    // tie call rid of cl, as returned by call_async, to the token.
+    // it is cancelled at once if the token is already
+    void add(RPCC *cl, int rid) {
+        if (rid < 0) return;
+        {
+            ScopedLock ml(&m_);
+            if (!cancelled_) {
+                calls_.push_back(std::make_pair(cl, rid));
+                return;
+            }
+        }
+        cl->cancel(rid);
+    }
+
+    // cancel the calls added so far and later ones,
+    // return how many were still pending
+    int cancel() {
+        std::vector<std::pair<RPCC *, unsigned int>> cs;
+        {
+            ScopedLock ml(&m_);
+            cancelled_ = true;
+            cs.swap(calls_);
+        }
+        int n = 0;
+        for (auto &&c : cs)
+            if (c.first->cancel(c.second)) n++;
+        return n;
+    }
+
+    bool cancelled() {
+        ScopedLock ml(&m_);
+        return cancelled_;
+    }
+};
+
+// base of both ends of a client stream, see stream.hpp for the frames
+class rpc_stream_end {
+protected:
+    RPCC *cl_;
+    unsigned int proc_;
+    uint64_t id_;
+    unsigned int window_;       // frames in flight at most
+    TO to_;
+    std::string args_;          // sent with the first frame
+    unsigned int seq_;          // next frame
+
+    pthread_mutex_t m_;         // protect the state updated by replies
+    pthread_cond_t c_;
+    unsigned int inflight_;
+    int err_;                   // first failure, 0 if none
+
+    template<class... Args>
+    rpc_stream_end(RPCC *cl, unsigned int proc, unsigned int window, TO to, const Args&... args)
+        : cl_(cl), proc_(proc), window_(window), to_(to), seq_(0), inflight_(0), err_(0) {
+        VERIFY(window_ > 0);
+        if constexpr (sizeof...(Args) > 0) {
+            marshall m(wire_size(args...));
+            (m << ... << args);
+            args_ = m.get_content();
+        }
+        id_ = cl->stream_ids_++;
+        VERIFY(pthread_mutex_init(&m_, 0) == 0);
+        VERIFY(pthread_cond_init(&c_, 0) == 0);
+    }
+
+    // replies touch this obj until the last one is in
+    ~rpc_stream_end() {
+        {
+            ScopedLock ml(&m_);
+            while (inflight_ > 0)
+                VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+        }
+        VERIFY(pthread_mutex_destroy(&m_) == 0);
+        VERIFY(pthread_cond_destroy(&c_) == 0);
+    }
+
+    // build the next frame into m
+    void frame(marshall &m, std::string_view chunk, unsigned char flags) {
+        std::string_view args = seq_ == 0 ? std::string_view(args_) : std::string_view();
+        m.reserve(wire_size(id_, proc_, seq_, flags) + 8 + args.size() + chunk.size());
+        m << id_ << proc_ << seq_ << flags << args << chunk;
+        seq_++;
+    }
+
+    // send the next frame without waiting, a failure is passed to cb
+    void send(std::string_view chunk, unsigned char flags,
+            std::function<void(int, unmarshall &)> cb) {
+        {
+            ScopedLock ml(&m_);
+            inflight_++;
+        }
+        marshall m;
+        frame(m, chunk, flags);
+        if (cl_->call_async1(rpc_const::stream, m, cb, (uint64_t)to_ * 1000) < 0) {
+            unmarshall un;
+            cb(rpc_const::stream_failure, un);
+        }
+    }
+
+    // a frame is done, keep the first failure
+    void done(int ret) {
+        ScopedLock ml(&m_);
+        inflight_--;
+        if (ret < 0 && err_ == 0) err_ = ret;
+        VERIFY(pthread_cond_broadcast(&c_) == 0);
+    }
+};
+
+// client side of an upload to a reg_stream_in handler.
+// write chunks in order, then close to get the reply of the handler.
+// at most window chunks are unacked, write blocks while they are
+class rpc_stream_writer : public rpc_stream_end {
+    bool closed_;
+
+public:
+    template<class... Args>
+    rpc_stream_writer(RPCC *cl, unsigned int proc, unsigned int window, TO to, const Args&... args)
+        : rpc_stream_end(cl, proc, window, to, args...), closed_(false) {}
+
+    // send data, split into chunks of at most RPC_STREAM_CHUNK.
+    // return < 0 if the stream has failed
+    int write(std::string_view data) {
+        VERIFY(!closed_);
+        do {
+            std::string_view chunk = data.substr(0, RPC_STREAM_CHUNK);
+            data.remove_prefix(chunk.size());
+            {
+                ScopedLock ml(&m_);
+                while (inflight_ >= window_ && err_ == 0)
+                    VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+                if (err_ < 0) return err_;
+            }
+            send(chunk, 0, [this](int ret, unmarshall &) { done(ret); });
+        } while (!data.empty());
+        return 0;
+    }
+
+    // send the last frame and wait until every chunk is acked,
+    // r is the reply of the handler to the last chunk
+    template<class R>
+    int close(R &r) {
+        VERIFY(!closed_);
+        closed_ = true;
         marshall m;
-        (m << ... << args);
-        return call_m(proc, m, r, to);
+        frame(m, std::string_view(), STREAM_LAST);
+        int ret = cl_->call_m(rpc_const::stream, m, r, to_);
+
+        // frames are handled in order, so earlier acks are mostly in already
+        ScopedLock ml(&m_);
+        while (inflight_ > 0)
+            VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+        if (ret >= 0 && err_ < 0) ret = err_;
+        return ret;
+    }
+};
+
+// client side of a download from a reg_stream_out handler.
+// up to window chunks are pulled ahead of read
+class rpc_stream_reader : public rpc_stream_end {
+    std::map<unsigned int, std::string> ready_;     // chunks pulled ahead by seq
+    unsigned int next_;     // seq of the next chunk to read
+    unsigned int end_;      // seq of the last chunk, UINT_MAX until known
+
+    void pull() {
+        unsigned int seq = seq_;
+        send(std::string_view(), STREAM_PULL, [this, seq](int ret, unmarshall &u) {
+            unsigned char last = 0;
+            std::string chunk;
+            if (ret >= 0) {
+                u >> last >> chunk;
+                if (!u.okdone()) ret = rpc_const::unmarshal_reply_failure;
+            }
+            ScopedLock ml(&m_);
+            if (ret >= 0 && seq <= end_) {
+                ready_[seq].swap(chunk);
+                if (last) end_ = seq;
+            }
+            inflight_--;
+            if (ret < 0 && err_ == 0) err_ = ret;
+            VERIFY(pthread_cond_broadcast(&c_) == 0);
+        });
+    }
+
+public:
+    template<class... Args>
+    rpc_stream_reader(RPCC *cl, unsigned int proc, unsigned int window, TO to, const Args&... args)
+        : rpc_stream_end(cl, proc, window, to, args...), next_(0), end_(UINT_MAX) {
+        for (unsigned int i = 0; i < window_; i++) pull();
+    }
+
+    // move the next chunk into chunk, return 1 if there was one,
+    // 0 at the end of the stream and < 0 if the stream has failed
+    int read(std::string &chunk) {
+        bool more;
+        {
+            ScopedLock ml(&m_);
+            if (end_ != UINT_MAX && next_ > end_) return 0;
+            while (!ready_.count(next_) && err_ == 0)
+                VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+            auto res = ready_.find(next_);
+            if (res == ready_.end()) return err_;
+            chunk.swap(res->second);
+            ready_.erase(res);
+            next_++;
+            more = end_ == UINT_MAX;
+        }
+        // keep window chunks ahead, never past a known end
+        if (more) pull();
+        return 1;
     }
 };
 
 static void *poll_thread(void *arg)
 {
     RPCC *c = (RPCC *)arg;
-	while (1) {
-    	c->poll_and_push();
-		if (errno == EINTR) break;
-	}
+	while (c->poll_and_push()) {}
     return NULL;
 }
-
-static int cmp_timespec(const struct timespec &a, const struct timespec &b) {
-	if(a.tv_sec > b.tv_sec)
-		return 1;
-	else if(a.tv_sec < b.tv_sec)
-		return -1;
-	else {
-		if(a.tv_nsec > b.tv_nsec)
-			return 1;
-		else if(a.tv_nsec < b.tv_nsec)
-			return -1;
-		else
-			return 0;
-	}
-}
-
-static void add_timespec(const struct timespec &a, int b, struct timespec *result) {
-	// convert to millisec, add timeout, convert back
-	result->tv_sec = a.tv_sec + b/1000;
-	result->tv_nsec = a.tv_nsec + (b % 1000) * 1000000;
-	VERIFY(result->tv_nsec >= 0);
-	while (result->tv_nsec > 1000000000){
-		result->tv_sec++;
-		result->tv_nsec-=1000000000;
-	}
-}
-
-static int diff_timespec(const struct timespec &end, const struct timespec &start) {
-	int diff = (end.tv_sec > start.tv_sec)?(end.tv_sec-start.tv_sec)*1000:0;
-	VERIFY(diff || end.tv_sec == start.tv_sec);
-	if(end.tv_nsec > start.tv_nsec){
-		diff += (end.tv_nsec-start.tv_nsec)/1000000;
-	} else {
-		diff -= (start.tv_nsec-end.tv_nsec)/1000000;
-	}
-	return diff;
-}
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
+#include <algorithm>
 #include <list>
 #include <map>
 #include <set>
@@ -16,165 +18,728 @@
 
 #include "common.hpp"
 #include "connection.hpp"
+#include "pollmgr.hpp"
+#include "thr_pool.hpp"
+#include "proc_table.hpp"
+#include "stream.hpp"
+#include "reply_cache.hpp"
 #include "utils/verify.h"
 #include "utils/slock.h"
+#include "utils/timer.h"
+
+// the call a handler is running for, see RPCS::call_ctx
+struct rpc_call_ctx {
+	unsigned int clt_id;
+	int rid;
+	unsigned int proc;
+	uint64_t ddl;		// when the client gives up in timer::get_usec time, 0 if never
+	reply_cache *cache;
+
+	// usec left before the client gives up, UINT64_MAX if never.
+	// a long handler may check it and give up as well
+	uint64_t remaining() const {
+		if (ddl == 0) return UINT64_MAX;
+		uint64_t now = timer::get_usec();
+		return ddl > now ? ddl - now : 0;
+	}
+
+	// if the client has cancelled the call or is done waiting for it,
+	// a long handler may check it and stop early
+	bool cancelled() const { return cache->gone(clt_id, rid); }
+};
+
+// call of the handler running on this thread
+inline thread_local const rpc_call_ctx *rpc_cur_call = NULL;
+
+// make c the call of this thread while in scope
+class rpc_call_scope {
+	const rpc_call_ctx *prev_;
+public:
+	rpc_call_scope(const rpc_call_ctx *c): prev_(rpc_cur_call) { rpc_cur_call = c; }
+	~rpc_call_scope() { rpc_cur_call = prev_; }
+};
 
 // RPC server endpoint
 class RPCS {
-	int port_;		// the port to listen on
-	int tcp_; 		// file desciptor for accepting connection
-	unsigned int sid_;						// server id
-	std::map<int, handler *> procs_;		// handlers
-	std::map<int, Connection *> conns_;		// connections
-
-	// for select
-	fd_set fds;
-	int max_fd = 0;
-
-	// create tcp socket
-	bool tcp_conn(int port) {
-		struct sockaddr_in sin;
-		memset(&sin, 0, sizeof(sin));
-		sin.sin_family = AF_INET;
-		sin.sin_port = htons(port);
-
-		tcp_ = socket(AF_INET, SOCK_STREAM, 0);
-		if(tcp_ < 0){
-			perror("tcpsconn::tcpsconn accept_loop socket:");
-			return false;
+	class loop;
+
+	// a request handed to the worker pool
+	struct job {
+		loop *l;
+		Connection *c;
+		buffer req;
+		uint64_t arrival;	// usec it was read
+	};
+
+	// one call of a batch
+	struct batch_entry {
+		unsigned int proc;
+		std::string_view args;		// points into the batch request
+		int result;
+		marshall *rep;				// reply when run in parallel
+	};
+
+	// a batch shared by the thread that received it and the workers helping it.
+	// every thread claims entries until none is left
+	struct batch_job {
+		RPCS *srv;
+		rpc_call_ctx ctx;			// of the batch, seen by every entry
+		std::vector<batch_entry> es;
+		std::atomic<size_t> next;	// next entry to claim
+		std::atomic<size_t> left;	// entries not finished
+		std::atomic<int> refno;
+		pthread_mutex_t m;			// wait for left to drop to 0
+		pthread_cond_t c;
+
+		batch_job(RPCS *s, const rpc_call_ctx &x, std::vector<batch_entry> &&e)
+			: srv(s), ctx(x), es(std::move(e)), next(0), left(es.size()), refno(1) {
+			VERIFY(pthread_mutex_init(&m, 0) == 0);
+			VERIFY(pthread_cond_init(&c, 0) == 0);
 		}
 
-		int yes = 1;
-		setsockopt(tcp_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-		setsockopt(tcp_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		~batch_job() {
+			VERIFY(pthread_mutex_destroy(&m) == 0);
+			VERIFY(pthread_cond_destroy(&c) == 0);
+		}
 
-		if(bind(tcp_, (sockaddr *)&sin, sizeof(sin)) < 0){
-			perror("accept_loop tcp bind:");
-			return false;
+		void work() {
+			rpc_call_scope cs(&ctx);
+			size_t i;
+			while ((i = next++) < es.size()) {
+				es[i].rep = new marshall();
+				es[i].result = srv->run_entry(es[i].proc, es[i].args, *es[i].rep);
+				if (--left == 0) {
+					ScopedLock ml(&m);
+					VERIFY(pthread_cond_broadcast(&c) == 0);
+				}
+			}
 		}
 
-		if(listen(tcp_, 1000) < 0) {
-			perror("tcpsconn::tcpsconn listen:");
-			return false;
+		void wait() {
+			ScopedLock ml(&m);
+			while (left > 0)
+				VERIFY(pthread_cond_wait(&c, &m) == 0);
 		}
 
-		// printf("RPCS::tcpsconn listen on %d %d\n", port, sin.sin_port);
-		return true;
+		void incref() { refno++; }
+		void decref() {
+			if (--refno == 0) delete this;
+		}
+	};
 
-		// if (pipe(pipe_) < 0) {
-		// 	perror("accept_loop pipe:");
-		// 	return false;
-		// }
-		// int flags = fcntl(pipe_[0], F_GETFL, NULL);
-		// flags |= O_NONBLOCK;
-		// fcntl(pipe_[0], F_SETFL, flags);
-		// VERIFY((th_ = method_thread(this, false, &tcpsconn::accept_conn)) != 0); 
-	}
+	// server side of a stream, its frames run one at a time in order
+	struct stream_state {
+		rpc_stream s;
+		const stream_entry *e;
+		Connection *c;				// conn that opened the stream, only compared
+		pthread_mutex_t m;			// protect q and running
+		std::deque<std::pair<Connection *, buffer>> q;	// frames waiting to run
+		bool running;				// some thread is draining q
+		bool in_map;				// still in streams_ of its loop, under streams_m_
+		std::atomic<int> refno;		// held by streams_ and a draining thread
 
-	// start a new connection for a client
-	void connect() {
-		// printf("---RPCS::connect---\n");
-		sockaddr_in sin;
-		socklen_t slen = sizeof(sin);
-		// int s1 = accept4(tcp_, (sockaddr *)&sin, &slen, SOCK_NONBLOCK); 
-		int s1 = accept(tcp_, (sockaddr *)&sin, &slen); 
-		if (s1 < 0) {
-			printf("RPCS::connect failure, errno = %d\n", errno);
-			// pthread_exit(NULL);
-			return;
-		}
-
-		// printf("RPCS::connect got connection fd=%d %s:%d\n", 
-		// 		s1, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-
-		// add to meta
-		conns_[s1] = new Connection(s1);
-		FD_SET(s1, &fds);
-		if (max_fd < s1) max_fd = s1;
-	}
+		stream_state(const stream_entry *xe, Connection *xc)
+			: e(xe), c(xc), running(false), in_map(true), refno(1) {
+			VERIFY(pthread_mutex_init(&m, 0) == 0);
+		}
 
-	// end a connection
-	void disconnect(int fd) {
-		// printf("---RPCS::disconnect(fd = %d)---\n", fd);
-		// fd should be in conns
-		auto res = conns_.find(fd);
-		VERIFY(res != conns_.end());
-		// shutdown fd
-		delete res->second;
-		// erase fd from meta
-		conns_.erase(res);
-		FD_CLR(fd, &fds);
-		// find max fd
-		max_fd = -1;
-		for (auto &&iter : conns_)
-			if (iter.first > max_fd) max_fd = iter.first;
-	}
+		~stream_state() {
+			for (auto &&f : q) {
+				buf_free(f.second.buf);
+				f.first->decref();
+			}
+			VERIFY(pthread_mutex_destroy(&m) == 0);
+		}
 
-	// loop to accept && send msg from each socket
-	void poll_and_push() {
-		// printf("---RPCS::poll_and_push--- on fd_set: (%d) ", tcp_);
-		// for (auto &&conn : conns_) printf("%d ", conn.first);
-		// printf("\n");
-
-		int max = tcp_ < max_fd? max_fd: tcp_;
-		fd_set rfds, wfds;
-		rfds = wfds = fds;
-		FD_SET(tcp_, &rfds);
-		for (auto &&conn : conns_)
-			if (conn.second->empty_wbuf()) 
-				FD_CLR(conn.first, &wfds);
-
-		int ret = select(max + 1, &rfds, &wfds, NULL, NULL);
-		// printf("RPCS::poll_and_push %d socket ready...\n", ret);
-
-		if (ret < 0) {
-			if (errno == EINTR) {
-				return;
-			} else {
-				printf("RPCS::poll_and_push select failure, errno %d\n",errno);
-				VERIFY(0);
+		void incref() { refno++; }
+		void decref() {
+			if (--refno == 0) delete this;
+		}
+	};
+
+	// a stream handed to the worker pool to drain
+	struct stream_job {
+		loop *l;
+		stream_state *st;
+	};
+
+	// one event loop, owns a listening socket and its slice of connections
+	class loop {
+		RPCS *srv_;
+		int tcp_; 		// file desciptor for accepting connection
+		pthread_t th_;	// loop thread, unused by the first loop
+		bool spawned_;	// th_ runs the loop
+
+		// run stops at its next pass once stop_ is set
+		std::atomic<bool> stop_;
+		pthread_mutex_t run_m_;		// protect running_
+		pthread_cond_t run_c_;
+		bool running_;				// some thread is in run
+		std::map<int, Connection *> conns_;		// connections
+
+		// edge-triggered event loop
+		PollMgr poll_;
+		std::set<int> rd_pending_;		// conns with unread msgs left after MAX_MSG_CNT
+		std::set<int> active_;			// conns touched in current iteration
+
+		// work the pool had no room for. a conn with a held msg is not read
+		// until the msg is taken, so a full pool pushes back on its clients
+		std::map<int, job *> held_;					// by conn
+		std::vector<stream_job *> held_streams_;	// in the order they came
+
+		// replies finished by worker threads
+		int evfd_;						// wakes up the loop when done_ is filled
+		pthread_mutex_t done_m_;		// protect done_
+		std::vector<Connection *> done_;	// conns with new replies queued
+
+		// open streams of this loop's conns by (clt_id, stream id)
+		pthread_mutex_t streams_m_;		// protect streams_ and in_map of its streams
+		std::map<std::pair<unsigned int, uint64_t>, stream_state *> streams_;
+
+		// create tcp socket
+		bool tcp_conn(int port, bool reuseport) {
+			struct sockaddr_in sin;
+			memset(&sin, 0, sizeof(sin));
+			sin.sin_family = AF_INET;
+			sin.sin_port = htons(port);
+
+			tcp_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if(tcp_ < 0){
+				perror("tcpsconn::tcpsconn accept_loop socket:");
+				return false;
+			}
+
+			int yes = 1;
+			setsockopt(tcp_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+			setsockopt(tcp_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+			// let the kernel spread new connections among loops
+			if (reuseport)
+				setsockopt(tcp_, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+
+			if(bind(tcp_, (sockaddr *)&sin, sizeof(sin)) < 0){
+				perror("accept_loop tcp bind:");
+				return false;
+			}
+
+			if(listen(tcp_, 1000) < 0) {
+				perror("tcpsconn::tcpsconn listen:");
+				return false;
 			}
+
+			// edge-triggered, so accept until EAGAIN
+			poll_.add(tcp_);
+
+			// printf("RPCS::loop::tcpsconn listen on %d %d\n", port, sin.sin_port);
+			return true;
+
+			// if (pipe(pipe_) < 0) {
+			// 	perror("accept_loop pipe:");
+			// 	return false;
+			// }
+			// int flags = fcntl(pipe_[0], F_GETFL, NULL);
+			// flags |= O_NONBLOCK;
+			// fcntl(pipe_[0], F_SETFL, flags);
+			// VERIFY((th_ = method_thread(this, false, &tcpsconn::accept_conn)) != 0); 
 		}
 
-		if (FD_ISSET(tcp_, &rfds)) {connect();}
-		for (auto &&con: conns_) {
-			if (FD_ISSET(con.first, &rfds)) {con.second->read_cb();}
-			if (FD_ISSET(con.first, &wfds)) {con.second->write_cb();}
+		// start new connections for pending clients
+		void connect() {
+			// printf("---RPCS::loop::connect---\n");
+			while (1) {
+				sockaddr_in sin;
+				socklen_t slen = sizeof(sin);
+				int s1 = accept4(tcp_, (sockaddr *)&sin, &slen, SOCK_NONBLOCK | SOCK_CLOEXEC); 
+				if (s1 < 0) {
+					if (errno != EAGAIN && errno != EWOULDBLOCK)
+						printf("RPCS::loop::connect failure, errno = %d\n", errno);
+					return;
+				}
+
+				// printf("RPCS::loop::connect got connection fd=%d %s:%d\n", 
+				// 		s1, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+
+				// add to meta
+				Connection *c = new Connection(s1);
+				if (srv_->zc_min_) c->zerocopy(srv_->zc_min_);
+				c->compression(srv_->lz_min_);
+				conns_[s1] = c;
+				poll_.add(s1);
+			}
+		}
+
+		// end a connection
+		void disconnect(int fd) {
+			// printf("---RPCS::loop::disconnect(fd = %d)---\n", fd);
+			// fd should be in conns
+			auto res = conns_.find(fd);
+			VERIFY(res != conns_.end());
+			// shutdown fd, in-flight jobs may still hold the conn
+			poll_.del(fd);
+			drop_streams(res->second);
+			// its client cannot retransmit on another conn
+			if (res->second->clt_id) srv_->replies_.forget(res->second->clt_id);
+			res->second->closeCh();
+			res->second->decref();
+			// erase fd from meta
+			conns_.erase(res);
+			rd_pending_.erase(fd);
+			auto h = held_.find(fd);
+			if (h != held_.end()) {
+				drop_job(h->second);
+				held_.erase(h);
+			}
+		}
+
+		// arm write interest only while conn has queued msgs
+		void update_interest(Connection *c) {
+			if (c->is_dead()) return;
+			bool wr = !c->empty_wbuf();
+			if (wr == c->wr_armed) return;
+			poll_.mod(c->channo(), wr);
+			c->wr_armed = wr;
+		}
+
+		// wait for ready sockets, then accept && send && read on them.
+		// return false once the loop is to end
+		bool poll_and_push() {
+			// printf("---RPCS::loop::poll_and_push--- on %lu conns\n", conns_.size());
+
+			// don't block if some conn still has msgs to read. a worker
+			// that is done, or the pool once it has room for held work,
+			// wakes the loop
+			bool more = false;
+			for (auto &&fd : rd_pending_)
+				if (!held_.count(fd)) {more = true; break;}
+			int ret = poll_.wait(more ? 0 : -1);
+			if (stop_) return false;
+			// printf("RPCS::loop::poll_and_push %d socket ready...\n", ret);
+
+			if (ret < 0) {
+				if (errno == EINTR) {
+					return true;	// a signal, wait again
+				} else {
+					printf("RPCS::loop::poll_and_push epoll failure, errno %d\n",errno);
+					VERIFY(0);
+				}
+			}
+
+			for (int i = 0; i < ret; i++) {
+				int fd = poll_.fd(i);
+				if (fd == tcp_) {connect(); continue;}
+				if (fd == evfd_) {flush_done(); continue;}
+				auto res = conns_.find(fd);
+				if (res == conns_.end()) continue;
+				if (poll_.writable(i)) {res->second->write_cb(); active_.insert(fd);}
+				if (poll_.readable(i)) rd_pending_.insert(fd);
+			}
+
+			// read at most MAX_MSG_CNT msgs per conn for fairness
+			for (auto iter = rd_pending_.begin(); iter != rd_pending_.end(); ) {
+				if (held_.count(*iter)) {iter++; continue;}
+				active_.insert(*iter);
+				if (conns_[*iter]->read_cb()) iter++;
+				else iter = rd_pending_.erase(iter);
+			}
+			return true;
 		}
-	}
 	
-	// process all msgs in read buffer
-	void process() {
-		// printf("---RPCS::process---\n");
-		for (auto &&conn : conns_) {
-			// for each conn, process its rbuf queue
-			for (size_t i = 0; i < conn.second->rbuf_cnt(); i++) {
-				buffer buf = conn.second->next_rbuf();
-				VERIFY(buf.sz == buf.solong);
-				process_msg(conn.second, buf.buf, buf.sz);
-				free(buf.buf);
+		// process all msgs in read buffer of touched conns
+		void process() {
+			// printf("---RPCS::loop::process---\n");
+			uint64_t now = timer::get_usec();	// when the msgs were read, near enough
+
+			// held work goes first, in order
+			while (!held_streams_.empty() && dispatch_stream(held_streams_.front()))
+				held_streams_.erase(held_streams_.begin());
+			for (auto &&h : held_) active_.insert(h.first);
+
+			for (auto &&fd : active_) {
+				// for each conn, process its rbuf queue
+				Connection *c = conns_[fd];
+				auto h = held_.find(fd);
+				if (h != held_.end()) {
+					if (!dispatch(h->second)) continue;
+					held_.erase(h);
+				}
+				while (c->rbuf_cnt() > 0) {
+					buffer buf = c->next_rbuf();
+					VERIFY(buf.sz == buf.solong);
+					if (!c->clt_id) {
+						c->clt_id = clt_of(buf);
+						srv_->replies_.open(c->clt_id);
+					}
+					if (take_cancel(buf)) continue;
+					if (stream_enqueue(c, buf)) continue;
+					if (srv_->pool_) {
+						c->incref();
+						job *j = new job{this, c, buf, now};
+						if (dispatch(j)) continue;
+						// the pool is full, read no more of c until it takes j
+						held_[fd] = j;
+						break;
+					}
+
+					// no pool, run handler inline
+					marshall rep;
+					bool has_reply = srv_->process_msg(buf.buf, buf.sz, now, rep);
+					buf_free(buf.buf);
+					if (has_reply) reply_inline(c, rep);
+				}
+				update_interest(c);
 			}
 		}
-	}
 
-	// remove all dead connections
-	void sweep() {
-		// printf("---RPCS::sweep---\n");
+		// client id in the header of a request
+		static unsigned int clt_of(const buffer &buf) {
+			unmarshall req(buf.buf, buf.sz);
+			req_header h;
+			req.unpack_req_header(&h);
+			return req.ok() ? h.clt_id : 0;
+		}
 
-		// find dead connections
-		std::vector<int> dump_fds;
-		for (auto &&conn : conns_) {
-			if (conn.second->is_dead()) 
-				dump_fds.push_back(conn.first);
+		// apply a cancel frame on the loop thread, before the request it
+		// cancels gets to a worker. return false if buf is not one
+		bool take_cancel(const buffer &buf) {
+			unmarshall req(buf.buf, buf.sz);
+			req_header h;
+			req.unpack_req_header(&h);
+			if (!req.ok() || h.proc != (int)rpc_const::cancel) return false;
+			srv_->replies_.cancel(h.clt_id, h.rid);
+			buf_free(buf.buf);
+			return true;
 		}
 
-		// remove dead connections
-		for (auto &&fd : dump_fds) disconnect(fd);
-	}
-	
-	// porcess a single msg
-	void process_msg(Connection *c, char *buf, size_t sz) {
-		// printf("---RPCS::process_msg(c = %d, buf = %p, sz = %lu)---\n", c->channo(), buf, sz);
+		// send a reply from the loop thread.
+		// a small reply never leaves the stack unless the socket is full
+		void reply_inline(Connection *c, marshall &rep) {
+			if (c->checksummed()) rep.flatten();	// a checksum covers the blob too
+			if (rep.inlined() && !rep.has_file()) {
+				c->send_copy(rep.cstr(), rep.size());
+			} else {
+				buffer reply;
+				rep.take_buf(&reply.buf, &reply.sz, &reply.file);
+				c->send(reply);
+			}
+		}
+
+		// queue a reply from a worker thread, takes over a reference of c
+		void reply_async(Connection *c, marshall &rep) {
+			if (c->is_dead()) {
+				c->decref();
+				return;
+			}
+			if (c->checksummed()) rep.flatten();
+			buffer reply;
+			rep.take_buf(&reply.buf, &reply.sz, &reply.file);
+			c->add_wbuf(reply);
+			complete(c);	// the loop drops the reference
+		}
+
+		// queue a stream frame behind the earlier frames of its stream,
+		// return false if buf is not a stream frame
+		bool stream_enqueue(Connection *c, buffer buf) {
+			unmarshall req(buf.buf, buf.sz);
+			req_header h;
+			req.unpack_req_header(&h);
+			if (!req.ok() || h.proc != (int)rpc_const::stream) return false;
+
+			// a malformed stream frame is failed by process_msg
+			stream_frame f;
+			if (!f.decode(buf.buf, buf.sz)) return false;
+
+			stream_state *st;
+			bool run;
+			{
+				ScopedLock sl(&streams_m_);
+				auto key = std::make_pair(f.h.clt_id, f.id);
+				auto res = streams_.find(key);
+				if (res == streams_.end()) {
+					const stream_entry *e = srv_->sprocs_.find(f.proc);
+					// only the first frame opens a stream, frames of a stream that
+					// is over are answered by process_msg
+					if (f.seq != 0 || !e) return false;
+					st = new stream_state(e, c);
+					st->s.id = f.id;
+					st->s.clt_id = f.h.clt_id;
+					st->s.proc = f.proc;
+					st->s.args = std::string(f.args);
+					streams_[key] = st;
+				} else {
+					st = res->second;
+				}
+
+				ScopedLock ml(&st->m);
+				c->incref();
+				st->q.push_back(std::make_pair(c, buf));
+				run = !st->running;
+				st->running = true;
+				if (run) st->incref();	// for the draining thread
+			}
+			if (!run) return true;
+
+			if (!srv_->pool_) {
+				drain(st, true);
+				return true;
+			}
+			// later frames queue behind in st while it waits for the pool
+			stream_job *j = new stream_job{this, st};
+			if (!held_streams_.empty() || !dispatch_stream(j)) held_streams_.push_back(j);
+			return true;
+		}
+
+		bool dispatch_stream(stream_job *j) {
+			return srv_->pool_->add_job(run_stream, j);
+		}
+
+		// run queued frames of st in order until there is none
+		void drain(stream_state *st, bool on_loop) {
+			while (1) {
+				std::pair<Connection *, buffer> f;
+				{
+					ScopedLock ml(&st->m);
+					if (st->q.empty()) {
+						st->running = false;
+						break;
+					}
+					f = st->q.front();
+					st->q.pop_front();
+				}
+
+				marshall rep;
+				bool has_reply = srv_->process_stream(st->s, st->e, f.second.buf, f.second.sz, rep);
+				buf_free(f.second.buf);
+				if (st->s.eof) end_stream(st);
+				if (!has_reply) {
+					f.first->decref();
+				} else if (on_loop) {
+					reply_inline(f.first, rep);
+					f.first->decref();
+				} else {
+					reply_async(f.first, rep);
+				}
+			}
+			st->decref();
+		}
+
+		// run by a worker thread
+		static void *run_stream(void *arg) {
+			stream_job *j = (stream_job *)arg;
+			j->l->drain(j->st, false);
+			delete j;
+			return NULL;
+		}
+
+		// forget a stream that is over, later frames of it are failed
+		void end_stream(stream_state *st) {
+			{
+				ScopedLock sl(&streams_m_);
+				if (!st->in_map) return;
+				st->in_map = false;
+				streams_.erase(std::make_pair(st->s.clt_id, st->s.id));
+			}
+			st->decref();
+		}
+
+		// forget the streams of a closed conn, their handlers see no more chunks
+		void drop_streams(Connection *c) {
+			std::vector<stream_state *> dropped;
+			{
+				ScopedLock sl(&streams_m_);
+				for (auto it = streams_.begin(); it != streams_.end(); ) {
+					if (it->second->c != c) {
+						it++;
+						continue;
+					}
+					it->second->in_map = false;
+					dropped.push_back(it->second);
+					it = streams_.erase(it);
+				}
+			}
+			for (auto &&st : dropped) st->decref();
+		}
+
+		// hand a request to the worker pool, the reply comes back through done_.
+		// false if the pool is full
+		bool dispatch(job *j) {
+			return srv_->pool_->add_job(run_job, j, j->c->channo());
+		}
+
+		// free a job that never ran
+		static void drop_job(job *j) {
+			buf_free(j->req.buf);
+			j->c->decref();
+			delete j;
+		}
+
+		// run by a worker thread
+		static void *run_job(void *arg) {
+			job *j = (job *)arg;
+			marshall rep;
+			// no one is left to reply to, and its client may already be forgotten
+			bool has_reply = !j->c->is_dead() &&
+				j->l->srv_->process_msg(j->req.buf, j->req.sz, j->arrival, rep);
+			buf_free(j->req.buf);
+			if (has_reply) j->l->reply_async(j->c, rep);
+			else j->c->decref();
+			delete j;
+			return NULL;
+		}
+
+		// queue a conn with new replies and wake up the loop if needed
+		void complete(Connection *c) {
+			bool wake;
+			{
+				ScopedLock dl(&done_m_);
+				wake = done_.empty();
+				done_.push_back(c);
+			}
+			uint64_t one = 1;
+			if (wake && write(evfd_, &one, sizeof(one)) != sizeof(one))
+				printf("RPCS::loop::complete eventfd failure, errno = %d\n", errno);
+		}
+
+		// write replies finished by workers
+		void flush_done() {
+			uint64_t cnt;
+			std::vector<Connection *> done;
+			while (read(evfd_, &cnt, sizeof(cnt)) > 0) {}
+			{
+				ScopedLock dl(&done_m_);
+				done.swap(done_);
+			}
+			for (auto &&c : done) {
+				if (!c->is_dead()) {
+					c->write_cb();
+					update_interest(c);
+					if (c->is_dead()) active_.insert(c->channo());
+				}
+				c->decref();
+			}
+		}
+
+		// remove dead connections among touched conns
+		void sweep() {
+			// printf("---RPCS::loop::sweep---\n");
+
+			// find dead connections
+			std::vector<int> dump_fds;
+			for (auto &&fd : active_) {
+				if (conns_[fd]->is_dead()) 
+					dump_fds.push_back(fd);
+			}
+			active_.clear();
+
+			// remove dead connections
+			for (auto &&fd : dump_fds) disconnect(fd);
+		}
+
+	public:
+		loop(RPCS *srv, int port, bool reuseport)
+			: srv_(srv), spawned_(false), stop_(false), running_(false) {
+			VERIFY(pthread_mutex_init(&run_m_, 0) == 0);
+			VERIFY(pthread_cond_init(&run_c_, 0) == 0);
+			VERIFY(pthread_mutex_init(&done_m_, 0) == 0);
+			VERIFY(pthread_mutex_init(&streams_m_, 0) == 0);
+			evfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			VERIFY(evfd_ >= 0);
+			poll_.add(evfd_);
+			VERIFY(tcp_conn(port, reuseport));
+		}
+
+		~loop() {
+			// close all connections
+			close(tcp_);
+			close(evfd_);
+			for (auto &&st : streams_)
+				st.second->decref();
+			for (auto &&h : held_) drop_job(h.second);
+			for (auto &&j : held_streams_) {
+				j->st->decref();
+				delete j;
+			}
+			// replies of the last jobs, never written
+			for (auto &&c : done_) c->decref();
+			for (auto &&conn : conns_) {
+				conn.second->closeCh();
+				conn.second->decref();
+			}
+			VERIFY(pthread_mutex_destroy(&done_m_) == 0);
+			VERIFY(pthread_mutex_destroy(&streams_m_) == 0);
+			VERIFY(pthread_mutex_destroy(&run_m_) == 0);
+			VERIFY(pthread_cond_destroy(&run_c_) == 0);
+		}
+
+		// constantly do polling pushing and processing
+		void run() {
+			{
+				ScopedLock rl(&run_m_);
+				running_ = true;
+			}
+			while (poll_and_push()) {
+				process();
+				sweep();
+			}
+			ScopedLock rl(&run_m_);
+			running_ = false;
+			VERIFY(pthread_cond_broadcast(&run_c_) == 0);
+		}
+
+		// run the loop in a new thread
+		void spawn() {
+			int err = pthread_create(&th_, NULL, loop_thread, this);
+			if (err != 0) {
+				fprintf(stderr, "pthread_create ret %d %s\n", err, strerror(err));
+				exit(1);
+			}
+			spawned_ = true;
+		}
+
+		// make run return, from any thread
+		void stop() {
+			stop_ = true;
+			wake();
+		}
+
+		// make the loop go around once, from any thread
+		void wake() {
+			uint64_t one = 1;
+			if (write(evfd_, &one, sizeof(one)) != sizeof(one))
+				printf("RPCS::loop::wake eventfd failure, errno = %d\n", errno);
+		}
+
+		// wait for run to return after stop
+		void join() {
+			if (spawned_) {
+				VERIFY(pthread_join(th_, NULL) == 0);
+				spawned_ = false;
+				return;
+			}
+			ScopedLock rl(&run_m_);
+			while (running_)
+				VERIFY(pthread_cond_wait(&run_c_, &run_m_) == 0);
+		}
+
+		static void *loop_thread(void *arg) {
+			((loop *)arg)->run();
+			return NULL;
+		}
+	};
+
+	int port_;		// the port to listen on
+	unsigned int sid_;						// server id
+	proc_table<proc_entry> procs_;			// handlers, read only once started
+	proc_table<stream_entry> sprocs_;		// stream handlers
+	std::vector<loop *> loops_;				// event loops
+	ThrPool *pool_;							// handler workers, NULL to run inline
+	size_t zc_min_;							// replies sent with MSG_ZEROCOPY from this size, 0 if off
+	size_t lz_min_;							// replies compressed from this size for clients that ask, 0 if off
+	reply_cache replies_;					// replies kept for retransmitted requests
+	std::atomic<uint64_t> shed_;			// calls shed past their deadline
+
+	// porcess a single msg read at usec arrival and build its reply in rep,
+	// return false if there is none
+	bool process_msg(char *buf, size_t sz, uint64_t arrival, marshall &rep) {
+		// printf("---RPCS::process_msg(buf = %p, sz = %lu)---\n", buf, sz);
 		unmarshall req(buf, sz);
 
 		// unpack msg
@@ -183,15 +748,20 @@ class RPCS {
 		int proc = h.proc;
 		if(!req.ok()){
 			printf("RPCS:process_msg unmarshall header failed!!!\n");
-			// c->decref();
-			return;
+			return false;
 		}
 		// printf("RPCS::process_msg: rpc %u (proc %x) from clt %u for srv instance %u \n",
 		// 		h.rid, proc, h.clt_id, h.srv_id);
 
 		// reply
-		marshall rep;
 		reply_header rh(h.rid, 0);
+		bool cache = false;		// keep the reply for retransmits
+		rpc_call_ctx ctx;
+		ctx.clt_id = h.clt_id;
+		ctx.rid = h.rid;
+		ctx.proc = proc;
+		ctx.ddl = h.budget ? arrival + h.budget : 0;
+		ctx.cache = &replies_;
 
 		// is client sending to an old instance of server?
 		if(h.srv_id != 0 && h.srv_id != sid_){
@@ -199,17 +769,68 @@ class RPCS {
 			rh.result = rpc_const::oldsrv_failure;
 			goto send_reply;
 		}
-		
-		// is RPC proc a registered procedure?
-		if(procs_.count(proc) < 1){
-			printf("RPCS::process_msg unknown proc %x.\n", proc);
-			rh.result = rpc_const::unknown_proc;
+
+		// shed a call its client has given up on, before it costs anything.
+		// a retransmit comes with the budget left and may still run
+		if (ctx.ddl && timer::get_usec() >= ctx.ddl) {
+			shed_++;
+			rh.result = rpc_const::deadline_failure;
 			goto send_reply;
 		}
 
-		handler *f;
-		f = procs_[proc];
-		rh.result = f->fn(req, rep);
+		// at most once, stream frames have their own seq
+		if (proc != (int)rpc_const::stream) {
+			switch (replies_.check(h, rep, &rh.result)) {
+			case reply_cache::NEW:
+				cache = true;
+				break;
+			case reply_cache::INPROGRESS:
+			case reply_cache::CANCELLED:
+			case reply_cache::GONE:
+				return false;
+			case reply_cache::DONE:
+				goto send_reply;
+			case reply_cache::FORGOTTEN:
+				printf("RPCS::process_msg rid %d of clt %u is too old\n", h.rid, h.clt_id);
+				rh.result = rpc_const::atmostonce_failure;
+				goto send_reply;
+			}
+		}
+
+		if (proc == (int)rpc_const::stream) {
+			// frames that open or continue a stream never get here
+			stream_frame f;
+			if (!f.decode(buf, sz)) {
+				rh.result = rpc_const::unmarshal_args_failure;
+			} else if (f.flags & STREAM_PULL && f.seq != 0) {
+				// pulls sent ahead past the end of a download
+				rep << (unsigned char)1 << std::string_view();
+			} else {
+				printf("RPCS::process_msg no stream %lu of clt %u for proc %x seq %u\n",
+						(unsigned long)f.id, h.clt_id, f.proc, f.seq);
+				rh.result = f.seq == 0 ? rpc_const::unknown_proc : rpc_const::stream_failure;
+			}
+			goto send_reply;
+		}
+
+		if (proc == (int)rpc_const::batch) {
+			rpc_call_scope cs(&ctx);
+			rh.result = process_batch(req, rep);
+			if (rh.result < 0) printf("RPCS::process_msg bad batch from clt %u\n", h.clt_id);
+			goto send_reply;
+		}
+
+		// is RPC proc a registered procedure?
+		{
+			rpc_call_scope cs(&ctx);
+			const proc_entry *f = procs_.find(proc);
+			if(!f){
+				printf("RPCS::process_msg unknown proc %x.\n", proc);
+				rh.result = rpc_const::unknown_proc;
+				goto send_reply;
+			}
+			rh.result = f->fn(f->obj, req, rep);
+		}
 		if (rh.result == rpc_const::unmarshal_args_failure) {
 			printf("RPCS::process_msg failed to unmarshall the arguments of type 0x%x RPC!\n", proc);
 			// VERIFY(0);
@@ -219,26 +840,146 @@ class RPCS {
 		VERIFY(rh.result >= 0);
 
 	send_reply:
-		char *send_buf;
-		int send_sz;
+		if (cache) replies_.done(h, rh.result, rep);
 		rep.pack_reply_header(rh);
-		rep.take_buf(&send_buf, &send_sz);
 		// printf("RPCS::process_msg sending reply of size %d for rpc %u, proc %x result %d, clt %u\n",
-		// 		send_sz, h.rid, proc, rh.result, h.clt_id);
-		c->send(send_buf, send_sz);
+		// 		rep.size(), h.rid, proc, rh.result, h.clt_id);
+		return true;
+	}
+
+	// run by a worker once the pool has room again, loops holding back work retry it
+	static void pool_room(void *arg) {
+		for (auto &&l : ((RPCS *)arg)->loops_)
+			l->wake();
+	}
+
+	// run one call of a batch, its reply is appended to rep
+	int run_entry(unsigned int proc, std::string_view args, marshall &rep) {
+		const proc_entry *f = procs_.find(proc);
+		if (!f || proc == rpc_const::batch) {
+			printf("RPCS::run_entry unknown proc %x.\n", proc);
+			return rpc_const::unknown_proc;
+		}
+		// the entry runs for the batch, under its own proc
+		rpc_call_ctx ctx = *rpc_cur_call;
+		ctx.proc = proc;
+		rpc_call_scope cs(&ctx);
+		unmarshall u((char *)args.data(), args.size());
+		int ret = f->fn(f->obj, u, rep);
+		if (ret == rpc_const::unmarshal_args_failure)
+			printf("RPCS::run_entry failed to unmarshall the arguments of type 0x%x RPC!\n", proc);
+		return ret;
 	}
 
-	// register a single handler
-	void reg1(unsigned int proc, handler *h) {
-		VERIFY(procs_.count(proc) == 0);
-		procs_[proc] = h;
-		VERIFY(procs_.count(proc) >= 1);
+	static void *batch_help(void *arg) {
+		batch_job *b = (batch_job *)arg;
+		b->work();
+		b->decref();
+		return NULL;
+	}
+
+	// run every call of a batch and put their results in rep in order,
+	// spread among the worker pool if there is one.
+	// the batch is n (proc, args) entries, the reply n (result, reply) entries
+	int process_batch(unmarshall &req, marshall &rep) {
+		unsigned int n;
+		req >> n;
+		std::vector<batch_entry> es;
+		for (unsigned int i = 0; i < n && req.ok(); i++) {
+			batch_entry e = {0, std::string_view(), 0, NULL};
+			req >> e.proc >> e.args;
+			es.push_back(e);
+		}
+		if (!req.okdone()) return rpc_const::unmarshal_args_failure;
+
+		rep << (unsigned int)es.size();
+		if (!pool_ || es.size() < 2) {
+			// in order, each reply goes straight into rep
+			for (auto &&e : es) {
+				int at = rep.size();
+				rep << 0 << 0u;
+				int ret = run_entry(e.proc, e.args, rep);
+				rep.flatten();	// a blob can only go out at the end of a msg
+				rep.patch(at, ret);
+				rep.patch(at + 4, rep.size() - at - 8);
+			}
+			return 0;
+		}
+
+		// this thread works on the batch too, so it never waits for a queued job
+		batch_job *b = new batch_job(this, *rpc_cur_call, std::move(es));
+		size_t helpers = std::min(pool_->size(), b->es.size() - 1);
+		for (size_t i = 0; i < helpers; i++) {
+			b->incref();
+			if (!pool_->add_job(batch_help, b)) {
+				b->decref();
+				break;
+			}
+		}
+		b->work();
+		b->wait();
+
+		size_t total = 0;
+		for (auto &&e : b->es) {
+			e.rep->flatten();
+			total += 8 + e.rep->size() - RPC_HEADER_SZ;
+		}
+		rep.reserve(total);
+		for (auto &&e : b->es) {
+			rep << e.result;
+			rep << std::string_view(e.rep->cstr() + RPC_HEADER_SZ, e.rep->size() - RPC_HEADER_SZ);
+			delete e.rep;
+		}
+		b->decref();
+		return 0;
+	}
+
+	// run one frame of stream s and build its reply in rep
+	bool process_stream(rpc_stream &s, const stream_entry *e, char *buf, size_t sz, marshall &rep) {
+		stream_frame f;
+		if (!f.decode(buf, sz)) return false;
+		reply_header rh(f.h.rid, 0);
+		if (f.h.srv_id != 0 && f.h.srv_id != sid_) {
+			rh.result = rpc_const::oldsrv_failure;
+			s.eof = true;
+		} else if (s.eof) {
+			// the handler failed an earlier frame
+			if (f.flags & STREAM_PULL) rep << (unsigned char)1 << std::string_view();
+			else rh.result = rpc_const::stream_failure;
+		} else {
+			rh.result = e->fn(e->obj, s, f.chunk, f.flags & STREAM_LAST, rep);
+			// a failed handler ends its stream
+			if (rh.result < 0) s.eof = true;
+		}
+		rep.pack_reply_header(rh);
+		return true;
+	}
+
+	// register a single stream handler
+	template<class Fn>
+	void sreg1(unsigned int proc, Fn f,
+			int (*thunk)(void *, rpc_stream &, std::string_view, bool, marshall &)) {
+		VERIFY(!sprocs_.has(proc));
+		sprocs_.insert(proc, stream_entry{thunk, new Fn(std::move(f)), &handler_del<Fn>});
+	}
+
+	// register a single handler, its callable lives in procs_
+	template<class Tr, class Fn>
+	void reg1(unsigned int proc, Fn f) {
+		VERIFY(!procs_.has(proc) && proc != rpc_const::batch && proc != rpc_const::stream &&
+				proc != rpc_const::cancel);
+		procs_.insert(proc, proc_entry{&handler_thunk<Tr, Fn>, new Fn(std::move(f)), &handler_del<Fn>});
+		VERIFY(procs_.has(proc));
 	}	
 
 public:
-	RPCS(unsigned int port, int counts = 0)
-		:port_(port) {
-		// single thread, no need for lock
+	// n_loops > 1 shards connections among n_loops event loop threads,
+	// each loop has its own SO_REUSEPORT listening socket and no shared state.
+	// n_workers > 0 runs handlers on a worker pool instead of the loops.
+	// handlers may then run concurrently and must be thread safe.
+	RPCS(unsigned int port, int counts = 0, int n_loops = 1, int n_workers = 0)
+		:port_(port), pool_(NULL), zc_min_(0), lz_min_(COMPRESS_MIN_SZ), shed_(0) {
+		// procs_ is only written before start, no need for lock
 		// VERIFY(pthread_mutex_init(&procs_m_, 0) == 0);
 
 		// random server id
@@ -247,16 +988,23 @@ public:
 		srandom((int)ts.tv_nsec^((int)getpid()));
 		sid_ = random();
 		
-		FD_ZERO(&fds);
 		reg(rpc_const::bind, this, &RPCS::rpcbind);
-		VERIFY(tcp_conn(port_));
+		VERIFY(n_loops >= 1);
+		if (n_workers > 0) pool_ = new ThrPool(n_workers);
+		for (int i = 0; i < n_loops; i++)
+			loops_.push_back(new loop(this, port_, n_loops > 1));
+		if (pool_) pool_->on_room(pool_room, this);
 	}
 
 	~RPCS() {
-		// close all connections
-		close(tcp_);
-		for (auto &&conn : conns_)
-			delete conn.second;
+		// stop the loops, then finish in-flight jobs before their loops go away
+		for (auto &&l : loops_)
+			l->stop();
+		for (auto &&l : loops_)
+			l->join();
+		if (pool_) delete pool_;
+		for (auto &&l : loops_)
+			delete l;
 	}
 
 	// a default RPC handler for client binding
@@ -266,274 +1014,76 @@ public:
 		return 0;
 	}
 
-	// begin to listen on port and process msgs
-	void start() {
-		// constantly do polling pushing and processing
-		while (1) {
-			poll_and_push();
-			if (errno == EINTR) return;
-			process();
-			if (errno == EINTR) return;
-			sweep();
-		}
-	}
+	// send replies of at least min bytes with MSG_ZEROCOPY, see
+	// Connection::zerocopy. only applies to connections accepted later
+	void set_zerocopy(size_t min = ZEROCOPY_MIN_SZ) { zc_min_ = min; }
 
+	// compress replies of at least min bytes to clients that asked for it
+	// in bind, 0 turns it off. only applies to connections accepted later
+	void set_compression(size_t min) { lz_min_ = min; }
 
+	// the call of the handler running on this thread, NULL elsewhere.
+	// set for plain and batched calls, not for stream handlers
+	static const rpc_call_ctx *call_ctx() { return rpc_cur_call; }
 
-	// -----------register a handler of different parameters-----------
-	// TODO: variable-length parameter list
-	template<class S, class A1, class R> void
-	reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
-	{
-		class h1 : public handler {
-			private:
-				S * sob;
-				int (S::*meth)(const A1 a1, R & r);
-			public:
-				h1(S *xsob, int (S::*xmeth)(const A1 a1, R & r))
-					: sob(xsob), meth(xmeth) { }
-				int fn(unmarshall &args, marshall &ret) {
-					A1 a1;
-					R r;
-					args >> a1;
-					if(!args.okdone())
-						return rpc_const::unmarshal_args_failure;
-					int b = (sob->*meth)(a1, r);
-					ret << r;
-					return b;
-				}
-		};
-		reg1(proc, new h1(sob, meth));
+	// calls shed so far as they arrived or waited past their deadline
+	uint64_t shed() { return shed_; }
+
+	// begin to listen on port and process msgs
+	// the first loop runs in the calling thread, others in their own threads.
+	// returns once the RPCS is being destroyed
+	void start() {
+		for (size_t i = 1; i < loops_.size(); i++)
+			loops_[i]->spawn();
+		loops_[0]->run();
 	}
 
-	template<class S, class A1, class A2, class R> void
-	reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-				R & r))
+	// -----------register a handler-----------
+	// a handler is int f(A1 a1, ..., An an, R &r), args are decoded in place
+	// and moved in, so they may be taken by value, const ref or rvalue ref.
+
+	// member function meth of sob
+	template<class S, class M> void
+	reg(unsigned int proc, S *sob, M meth)
 	{
-		class h1 : public handler {
-			private:
-				S * sob;
-				int (S::*meth)(const A1 a1, const A2 a2, R & r);
-			public:
-				h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, R & r))
-					: sob(xsob), meth(xmeth) { }
-				int fn(unmarshall &args, marshall &ret) {
-					A1 a1;
-					A2 a2;
-					R r;
-					args >> a1;
-					args >> a2;
-					if(!args.okdone())
-						return rpc_const::unmarshal_args_failure;
-					int b = (sob->*meth)(a1, a2, r);
-					ret << r;
-					return b;
-				}
-		};
-		reg1(proc, new h1(sob, meth));
+		reg1<fn_traits<M>>(proc, bound_method<S, M>{sob, meth});
 	}
 
-	template<class S, class A1, class A2, class A3, class R> void
-	reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-				const A3 a3, R & r))
+	// free function or lambda
+	template<class F> void
+	reg(unsigned int proc, F f)
 	{
-		class h1 : public handler {
-			private:
-				S * sob;
-				int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R & r);
-			public:
-				h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, R & r))
-					: sob(xsob), meth(xmeth) { }
-				int fn(unmarshall &args, marshall &ret) {
-					A1 a1;
-					A2 a2;
-					A3 a3;
-					R r;
-					args >> a1;
-					args >> a2;
-					args >> a3;
-					if(!args.okdone())
-						return rpc_const::unmarshal_args_failure;
-					int b = (sob->*meth)(a1, a2, a3, r);
-					ret << r;
-					return b;
-				}
-		};
-		reg1(proc, new h1(sob, meth));
+		reg1<fn_traits<F>>(proc, std::move(f));
 	}
 
-	template<class S, class A1, class A2, class A3, class A4, class R> void
-	reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-				const A3 a3, const A4 a4, 
-				R & r))
+	// -----------register a stream handler-----------
+	// upload handler int f(rpc_stream &s, std::string_view chunk, bool last, R &r),
+	// called for each chunk in order. r goes back with the ack of the last chunk
+	template<class F> void
+	reg_stream_in(unsigned int proc, F f)
 	{
-		class h1 : public handler {
-			private:
-				S * sob;
-				int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R & r);
-			public:
-				h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-							const A4 a4, R & r))
-					: sob(xsob), meth(xmeth)  { }
-				int fn(unmarshall &args, marshall &ret) {
-					A1 a1;
-					A2 a2;
-					A3 a3;
-					A4 a4;
-					R r;
-					args >> a1;
-					args >> a2;
-					args >> a3;
-					args >> a4;
-					if(!args.okdone())
-						return rpc_const::unmarshal_args_failure;
-					int b = (sob->*meth)(a1, a2, a3, a4, r);
-					ret << r;
-					return b;
-				}
-		};
-		reg1(proc, new h1(sob, meth));
+		sreg1(proc, std::move(f), &stream_in_thunk<typename fn_traits<F>::reply, F>);
 	}
 
-	template<class S, class A1, class A2, class A3, class A4, class A5, class R> void
-	reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-				const A3 a3, const A4 a4, 
-				const A5 a5, R & r))
+	template<class S, class M> void
+	reg_stream_in(unsigned int proc, S *sob, M meth)
 	{
-		class h1 : public handler {
-			private:
-				S * sob;
-				int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-						const A5 a5, R & r);
-			public:
-				h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-							const A4 a4, const A5 a5, R & r))
-					: sob(xsob), meth(xmeth) { }
-				int fn(unmarshall &args, marshall &ret) {
-					A1 a1;
-					A2 a2;
-					A3 a3;
-					A4 a4;
-					A5 a5;
-					R r;
-					args >> a1;
-					args >> a2;
-					args >> a3;
-					args >> a4;
-					args >> a5;
-					if(!args.okdone())
-						return rpc_const::unmarshal_args_failure;
-					int b = (sob->*meth)(a1, a2, a3, a4, a5, r);
-					ret << r;
-					return b;
-				}
-		};
-		reg1(proc, new h1(sob, meth));
+		typedef bound_method<S, M> Fn;
+		sreg1(proc, Fn{sob, meth}, &stream_in_thunk<typename fn_traits<M>::reply, Fn>);
 	}
 
-	template<class S, class A1, class A2, class A3, class A4, class A5, class A6, class R> void
-	reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-				const A3 a3, const A4 a4, 
-				const A5 a5, const A6 a6, 
-				R & r))
+	// download handler int f(rpc_stream &s, std::string &chunk, bool &last),
+	// called for each pull to fill the next chunk of at most RPC_STREAM_CHUNK bytes
+	template<class F> void
+	reg_stream_out(unsigned int proc, F f)
 	{
-		class h1 : public handler {
-			private:
-				S * sob;
-				int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-						const A5 a5, const A6 a6, R & r);
-			public:
-				h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-							const A4 a4, const A5 a5, const A6 a6, R & r))
-					: sob(xsob), meth(xmeth) { }
-				int fn(unmarshall &args, marshall &ret) {
-					A1 a1;
-					A2 a2;
-					A3 a3;
-					A4 a4;
-					A5 a5;
-					A6 a6;
-					R r;
-					args >> a1;
-					args >> a2;
-					args >> a3;
-					args >> a4;
-					args >> a5;
-					args >> a6;
-					if(!args.okdone())
-						return rpc_const::unmarshal_args_failure;
-					int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, r);
-					ret << r;
-					return b;
-				}
-		};
-		reg1(proc, new h1(sob, meth));
+		sreg1(proc, std::move(f), &stream_out_thunk<F>);
 	}
 
-	template<class S, class A1, class A2, class A3, class A4, class A5, 
-		class A6, class A7, class R> void
-	reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-				const A3 a3, const A4 a4, 
-				const A5 a5, const A6 a6,
-				const A7 a7, R & r))
+	template<class S, class M> void
+	reg_stream_out(unsigned int proc, S *sob, M meth)
 	{
-		class h1 : public handler {
-			private:
-				S * sob;
-				int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-						const A5 a5, const A6 a6, const A7 a7, R & r);
-			public:
-				h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-							const A4 a4, const A5 a5, const A6 a6,
-							const A7 a7, R & r))
-					: sob(xsob), meth(xmeth) { }
-				int fn(unmarshall &args, marshall &ret) {
-					A1 a1;
-					A2 a2;
-					A3 a3;
-					A4 a4;
-					A5 a5;
-					A6 a6;
-					A7 a7;
-					R r;
-					args >> a1;
-					args >> a2;
-					args >> a3;
-					args >> a4;
-					args >> a5;
-					args >> a6;
-					args >> a7;
-					if(!args.okdone())
-						return rpc_const::unmarshal_args_failure;
-					int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, a7, r);
-					ret << r;
-					return b;
-				}
-		};
-		reg1(proc, new h1(sob, meth));
+		typedef bound_method<S, M> Fn;
+		sreg1(proc, Fn{sob, meth}, &stream_out_thunk<Fn>);
 	}
-
-	// template<class S, class R, class ...Args> void
-	// reg(unsigned int proc, S*sob, int (S::*meth)(R & r, const Args ... args))
-	// {
-	// 	class h1 : public handler {
-	// 		private:
-	// 			S * sob;
-	// 			int (S::*meth)(R & r, const Args ... args);
-	// 		public:
-	// 			h1(S *xsob, int (S::*xmeth)(R & r, const Args ... args))
-	// 				: sob(xsob), meth(xmeth) { }
-	// 			int fn(unmarshall &input, marshall &ret) {
-	// 				Args ... args;
-	// 				R r;
-	// 				(input >> ... >> args);
-	// 				if(!input.okdone())
-	// 					return rpc_const::unmarshal_args_failure;
-	// 				int b = (sob->*meth)(r, args);
-	// 				ret << r;
-	// 				return b;
-	// 			}
-	// 	};
-	// 	reg1(proc, new h1(sob, meth));
-	// }
 };
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+#include "common.hpp"
+#include "proc_table.hpp"
+
+#define RPC_STREAM_CHUNK (1 << 20)		// largest chunk of a stream frame, well below MAX_MSG_SZ
+#define RPC_STREAM_WINDOW 8				// default chunks in flight per stream
+
+// a stream is a sequence of frames to proc rpc_const::stream, each an
+// ordinary call whose reply acks it. the sender keeps at most a window
+// of frames unacked, so a transfer of any size holds bounded memory on
+// both ends, and a frame is acked only once the handler has consumed it.
+//
+// request body: id, proc, seq, flags, args (only read from seq 0), chunk
+// reply body: R of the handler on the last chunk of an upload,
+// (last, chunk) for a pull of a download
+enum {
+	STREAM_LAST = 1,		// last chunk of an upload
+	STREAM_PULL = 2,		// ask for the next chunk of a download
+};
+
+// one stream as seen by its handler, chunks are handed over one at a time in order
+struct rpc_stream {
+	uint64_t id;			// chosen by the client
+	unsigned int clt_id;
+	unsigned int proc;
+	uint64_t offset;		// bytes consumed (upload) or produced (download) before this chunk
+	std::string args;		// args the stream was opened with
+	void *ctx;				// free for the handler, e.g. state kept between chunks
+	bool eof;				// set once the last chunk is handled
+
+	rpc_stream(): id(0), clt_id(0), proc(0), offset(0), ctx(NULL), eof(false) {}
+
+	// unmarshall the args the stream was opened with
+	template <class... A>
+	bool get_args(A &... a) {
+		unmarshall u(args);
+		(void)(u >> ... >> a);
+		return u.okdone();
+	}
+};
+
+// a type-erased stream handler, see proc_entry
+struct stream_entry {
+	int (*fn)(void *obj, rpc_stream &s, std::string_view in, bool last, marshall &ret);
+	void *obj;
+	void (*del)(void *obj);
+};
+
+// upload handler int f(rpc_stream &s, std::string_view chunk, bool last, R &r),
+// r is sent back with the ack of the last chunk
+template <class R, class Fn>
+int stream_in_thunk(void *obj, rpc_stream &s, std::string_view in, bool last, marshall &ret) {
+	R r;
+	int b = (*(Fn *)obj)(s, in, last, r);
+	s.offset += in.size();
+	if (last) {
+		s.eof = true;
+		ret.reserve(wire_size(r));
+		ret << r;
+	}
+	return b;
+}
+
+// download handler int f(rpc_stream &s, std::string &chunk, bool &last),
+// called once per pull to fill the next chunk
+template <class Fn>
+int stream_out_thunk(void *obj, rpc_stream &s, std::string_view, bool, marshall &ret) {
+	std::string chunk;
+	bool last = false;
+	int b = (*(Fn *)obj)(s, chunk, last);
+	VERIFY(chunk.size() <= RPC_STREAM_CHUNK);
+	s.offset += chunk.size();
+	if (last) s.eof = true;
+	ret.reserve(1 + wire_size(chunk));
+	ret << (unsigned char)last << chunk;
+	return b;
+}
+
+// a frame of proc rpc_const::stream
+struct stream_frame {
+	req_header h;
+	uint64_t id;
+	unsigned int proc;
+	unsigned int seq;
+	unsigned char flags;
+	std::string_view args;		// point into the frame
+	std::string_view chunk;
+
+	bool decode(char *buf, size_t sz) {
+		unmarshall req(buf, sz);
+		req.unpack_req_header(&h);
+		req >> id >> proc >> seq >> flags >> args >> chunk;
+		return req.okdone();
+	}
+};
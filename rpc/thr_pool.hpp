@@ -0,0 +1,167 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "utils/verify.h"
+#include "utils/slock.h"
+
+#define THR_POOL_MAX_JOBS 4096		// default bound of queued jobs
+
+// bounded worker pool, one job deque per worker, idle workers steal
+class ThrPool {
+	struct job {
+		void *(*fn)(void *);
+		void *arg;
+	};
+
+	// per-worker job deque, owner pops the front and thieves take the back
+	struct worker {
+		pthread_t th;
+		pthread_mutex_t m;
+		std::deque<job> jobs;
+	};
+
+	std::vector<worker *> workers_;
+	size_t max_jobs_;
+	std::atomic<size_t> njobs_;		// queued jobs among all deques
+	std::atomic<int> sleepers_;		// idle workers waiting on c_
+	std::atomic<bool> stop_;
+	std::atomic<unsigned int> next_;	// round robin for jobs without a hint
+	std::atomic<bool> full_;		// a job was refused since one was last taken
+	void (*room_fn_)(void *);		// called once there is room again
+	void *room_arg_;
+
+	pthread_mutex_t m_;		// protect sleeping
+	pthread_cond_t c_;
+
+	struct worker_arg {
+		ThrPool *pool;
+		size_t id;
+	};
+
+	bool pop(size_t id, job *j) {
+		worker *w = workers_[id];
+		ScopedLock wl(&w->m);
+		if (w->jobs.empty()) return false;
+		*j = w->jobs.front();
+		w->jobs.pop_front();
+		return true;
+	}
+
+	bool steal(size_t id, job *j) {
+		for (size_t i = 1; i < workers_.size(); i++) {
+			worker *w = workers_[(id + i) % workers_.size()];
+			if (pthread_mutex_trylock(&w->m) != 0) continue;
+			bool got = !w->jobs.empty();
+			if (got) {
+				*j = w->jobs.back();
+				w->jobs.pop_back();
+			}
+			VERIFY(pthread_mutex_unlock(&w->m) == 0);
+			if (got) return true;
+		}
+		return false;
+	}
+
+	void do_work(size_t id) {
+		while (1) {
+			job j;
+			if (pop(id, &j) || steal(id, &j)) {
+				njobs_--;
+				if (full_ && full_.exchange(false) && room_fn_) room_fn_(room_arg_);
+				j.fn(j.arg);
+				continue;
+			}
+
+			// nothing to do, sleep until a job arrives
+			ScopedLock ml(&m_);
+			sleepers_++;
+			while (njobs_ == 0 && !stop_)
+				VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+			sleepers_--;
+			if (stop_ && njobs_ == 0) return;
+		}
+	}
+
+	static void *worker_thread(void *arg) {
+		worker_arg *wa = (worker_arg *)arg;
+		wa->pool->do_work(wa->id);
+		delete wa;
+		return NULL;
+	}
+
+public:
+	ThrPool(int n, size_t max_jobs = THR_POOL_MAX_JOBS)
+		: max_jobs_(max_jobs), njobs_(0), sleepers_(0), stop_(false), next_(0),
+		full_(false), room_fn_(NULL), room_arg_(NULL) {
+		VERIFY(n > 0);
+		VERIFY(pthread_mutex_init(&m_, 0) == 0);
+		VERIFY(pthread_cond_init(&c_, 0) == 0);
+		for (int i = 0; i < n; i++) {
+			worker *w = new worker();
+			VERIFY(pthread_mutex_init(&w->m, 0) == 0);
+			workers_.push_back(w);
+		}
+		for (int i = 0; i < n; i++) {
+			int err = pthread_create(&workers_[i]->th, NULL, worker_thread,
+					new worker_arg{this, (size_t)i});
+			if (err != 0) {
+				fprintf(stderr, "pthread_create ret %d %s\n", err, strerror(err));
+				exit(1);
+			}
+		}
+	}
+
+	~ThrPool() {
+		{
+			ScopedLock ml(&m_);
+			stop_ = true;
+			VERIFY(pthread_cond_broadcast(&c_) == 0);
+		}
+		// a worker may still steal from the others until it is joined
+		for (auto &&w : workers_)
+			VERIFY(pthread_join(w->th, NULL) == 0);
+		for (auto &&w : workers_) {
+			VERIFY(pthread_mutex_destroy(&w->m) == 0);
+			delete w;
+		}
+		VERIFY(pthread_mutex_destroy(&m_) == 0);
+		VERIFY(pthread_cond_destroy(&c_) == 0);
+	}
+
+	size_t size() { return workers_.size(); }
+
+	// have a worker call fn(arg) when it takes a job after add_job returned
+	// false, so whoever holds back work can retry. set before adding jobs
+	void on_room(void (*fn)(void *), void *arg) {
+		room_fn_ = fn;
+		room_arg_ = arg;
+	}
+
+	// queue fn(arg) on the deque of worker hint % size(), hint < 0 for round robin
+	// return false without queueing if the pool is full
+	bool add_job(void *(*fn)(void *), void *arg, int hint = -1) {
+		while (njobs_ >= max_jobs_) {
+			// a worker taking a job after this sees full_, one that took it
+			// before left room to look at again
+			full_ = true;
+			if (njobs_ >= max_jobs_) return false;
+		}
+		size_t id = (hint < 0 ? next_++ : (unsigned int)hint) % workers_.size();
+		njobs_++;
+		{
+			ScopedLock wl(&workers_[id]->m);
+			workers_[id]->jobs.push_back(job{fn, arg});
+		}
+		if (sleepers_ > 0) {
+			ScopedLock ml(&m_);
+			VERIFY(pthread_cond_signal(&c_) == 0);
+		}
+		return true;
+	}
+};
@@ -0,0 +1,107 @@
+#pragma once
+// byte swapping kernels for arrays of fixed-width integers.
+// the SIMD versions are picked at runtime, so the default build flags
+// (no -march) still get them on x86 machines that have the instructions.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BSWAP_X86 1
+#include <immintrin.h>
+#endif
+
+// scalar fallback, swap n elements of width W from src to dst
+template <int W>
+inline void bswap_copy_scalar(char *dst, const char *src, size_t n) {
+	for (size_t i = 0; i < n; i++, dst += W, src += W) {
+		if constexpr (W == 2) {
+			uint16_t x;
+			memcpy(&x, src, 2);
+			x = __builtin_bswap16(x);
+			memcpy(dst, &x, 2);
+		} else if constexpr (W == 4) {
+			uint32_t x;
+			memcpy(&x, src, 4);
+			x = __builtin_bswap32(x);
+			memcpy(dst, &x, 4);
+		} else {
+			uint64_t x;
+			memcpy(&x, src, 8);
+			x = __builtin_bswap64(x);
+			memcpy(dst, &x, 8);
+		}
+	}
+}
+
+#ifdef BSWAP_X86
+// pshufb pattern reversing every W-byte group of a 16 byte lane
+template <int W>
+struct bswap_pattern {
+	alignas(16) char m[16];
+	constexpr bswap_pattern(): m() {
+		for (int i = 0; i < 16; i++)
+			m[i] = (char)((i / W) * W + (W - 1 - i % W));
+	}
+};
+
+template <int W>
+__attribute__((target("ssse3")))
+inline size_t bswap_copy_ssse3(char *dst, const char *src, size_t n) {
+	size_t bytes = (n * W) & ~(size_t)15;
+	static constexpr bswap_pattern<W> p;
+	__m128i mask = _mm_load_si128((const __m128i *)p.m);
+	for (size_t i = 0; i < bytes; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(x, mask));
+	}
+	return bytes / W;
+}
+
+template <int W>
+__attribute__((target("avx2")))
+inline size_t bswap_copy_avx2(char *dst, const char *src, size_t n) {
+	size_t bytes = (n * W) & ~(size_t)31;
+	// vpshufb works per 128 bit lane, so the same pattern goes in both
+	static constexpr bswap_pattern<W> p;
+	__m128i half = _mm_load_si128((const __m128i *)p.m);
+	__m256i mask = _mm256_broadcastsi128_si256(half);
+	for (size_t i = 0; i < bytes; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(x, mask));
+	}
+	return bytes / W;
+}
+#endif
+
+// swap n elements of width W from src to dst, W is 1, 2, 4 or 8.
+// dst and src must not overlap
+template <int W>
+inline void bswap_copy(char *dst, const char *src, size_t n) {
+	static_assert(W == 1 || W == 2 || W == 4 || W == 8, "bad width");
+	if constexpr (W == 1) {
+		memcpy(dst, src, n);
+	} else {
+		size_t done = 0;
+#ifdef BSWAP_X86
+		static const int level = __builtin_cpu_supports("avx2") ? 2 :
+			(__builtin_cpu_supports("ssse3") ? 1 : 0);
+		if (level == 2)
+			done = bswap_copy_avx2<W>(dst, src, n);
+		else if (level == 1)
+			done = bswap_copy_ssse3<W>(dst, src, n);
+#endif
+		bswap_copy_scalar<W>(dst + done * W, src + done * W, n - done);
+	}
+}
+
+// copy n big-endian (network order) elements of width W to or from host order
+template <int W>
+inline void wire_copy(char *dst, const char *src, size_t n) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	memcpy(dst, src, n * W);
+#else
+	bswap_copy<W>(dst, src, n);
+#endif
+}
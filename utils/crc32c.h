@@ -0,0 +1,164 @@
+#pragma once
+// CRC32C (Castagnoli) of byte ranges.
+// x86 machines with SSE4.2 use the crc32 instruction on three interleaved
+// streams, others a slicing-by-8 table walk. the choice is made at runtime,
+// so the default build flags (no -march) still get the instruction.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32C_X86 1
+#include <immintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78		// reflected Castagnoli polynomial
+
+// slicing-by-8 tables, t[k][n] is the crc of byte n followed by k zero bytes
+struct crc32c_tables {
+	uint32_t t[8][256];
+	constexpr crc32c_tables(): t() {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+			t[0][n] = c;
+		}
+		for (uint32_t n = 0; n < 256; n++)
+			for (int k = 1; k < 8; k++)
+				t[k][n] = (t[k - 1][n] >> 8) ^ t[0][t[k - 1][n] & 0xff];
+	}
+};
+
+// software fallback, extend crc with n bytes at p
+inline uint32_t crc32c_sw(uint32_t crc, const char *p, size_t n) {
+	static constexpr crc32c_tables tb;
+	const uint32_t (*t)[256] = tb.t;
+	const unsigned char *b = (const unsigned char *)p;
+	crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (n >= 8) {
+		uint64_t w;
+		memcpy(&w, b, 8);
+		w ^= crc;
+		crc = t[7][w & 0xff] ^ t[6][(w >> 8) & 0xff] ^
+			t[5][(w >> 16) & 0xff] ^ t[4][(w >> 24) & 0xff] ^
+			t[3][(w >> 32) & 0xff] ^ t[2][(w >> 40) & 0xff] ^
+			t[1][(w >> 48) & 0xff] ^ t[0][w >> 56];
+		b += 8;
+		n -= 8;
+	}
+#endif
+	while (n--)
+		crc = t[0][(crc ^ *b++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#ifdef CRC32C_X86
+#define CRC32C_LONG 8192	// stream length of the interleaved loops
+#define CRC32C_SHORT 256
+
+// operators appending len zero bytes to a crc, applied a byte at a time,
+// so three independent crcs can be chained once their streams are done
+struct crc32c_shift_tables {
+	uint32_t lng[4][256];
+	uint32_t shrt[4][256];
+
+	static constexpr uint32_t times(const uint32_t *mat, uint32_t vec) {
+		uint32_t sum = 0;
+		for (; vec; vec >>= 1, mat++)
+			if (vec & 1) sum ^= *mat;
+		return sum;
+	}
+
+	static constexpr void square(uint32_t *sq, const uint32_t *mat) {
+		for (int n = 0; n < 32; n++)
+			sq[n] = times(mat, mat[n]);
+	}
+
+	// operator of len zero bytes, len is a power of 2
+	static constexpr void zeros(uint32_t tb[4][256], size_t len) {
+		uint32_t odd[32] = {}, even[32] = {};
+		odd[0] = CRC32C_POLY;		// one zero bit
+		for (int n = 1; n < 32; n++)
+			odd[n] = (uint32_t)1 << (n - 1);
+		square(even, odd);			// two zero bits
+		square(odd, even);			// four zero bits
+		const uint32_t *op = odd;
+		while (1) {
+			square(even, odd);
+			len >>= 1;
+			if (len == 0) {op = even; break;}
+			square(odd, even);
+			len >>= 1;
+			if (len == 0) {op = odd; break;}
+		}
+		for (uint32_t n = 0; n < 256; n++)
+			for (int k = 0; k < 4; k++)
+				tb[k][n] = times(op, n << (8 * k));
+	}
+
+	constexpr crc32c_shift_tables(): lng(), shrt() {
+		zeros(lng, CRC32C_LONG);
+		zeros(shrt, CRC32C_SHORT);
+	}
+
+	static uint32_t shift(const uint32_t tb[4][256], uint32_t crc) {
+		return tb[0][crc & 0xff] ^ tb[1][(crc >> 8) & 0xff] ^
+			tb[2][(crc >> 16) & 0xff] ^ tb[3][crc >> 24];
+	}
+};
+
+// three streams per round keep the crc32 unit busy, its latency is 3 cycles
+template <size_t L>
+__attribute__((target("sse4.2")))
+inline uint64_t crc32c_rounds(uint64_t crc, const char *&p, size_t &n, const uint32_t tb[4][256]) {
+	while (n >= 3 * L) {
+		uint64_t c1 = 0, c2 = 0;
+		for (const char *end = p + L; p < end; p += 8) {
+			uint64_t w0, w1, w2;
+			memcpy(&w0, p, 8);
+			memcpy(&w1, p + L, 8);
+			memcpy(&w2, p + 2 * L, 8);
+			crc = _mm_crc32_u64(crc, w0);
+			c1 = _mm_crc32_u64(c1, w1);
+			c2 = _mm_crc32_u64(c2, w2);
+		}
+		crc = crc32c_shift_tables::shift(tb, (uint32_t)crc) ^ c1;
+		crc = crc32c_shift_tables::shift(tb, (uint32_t)crc) ^ c2;
+		p += 2 * L;
+		n -= 3 * L;
+	}
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_hw(uint32_t crc, const char *p, size_t n) {
+	static constexpr crc32c_shift_tables tb;
+	uint64_t c = ~crc;
+	while (n && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		n--;
+	}
+	c = crc32c_rounds<CRC32C_LONG>(c, p, n, tb.lng);
+	c = crc32c_rounds<CRC32C_SHORT>(c, p, n, tb.shrt);
+	for (; n >= 8; p += 8, n -= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	while (n--)
+		c = _mm_crc32_u8(c, *p++);
+	return ~(uint32_t)c;
+}
+#endif
+
+// extend crc (0 to start) with n bytes at p
+inline uint32_t crc32c(uint32_t crc, const char *p, size_t n) {
+#ifdef CRC32C_X86
+	static const bool hw = __builtin_cpu_supports("sse4.2");
+	if (hw) return crc32c_hw(crc, p, n);
+#endif
+	return crc32c_sw(crc, p, n);
+}
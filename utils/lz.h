@@ -0,0 +1,163 @@
+#pragma once
+// a small LZ77 block codec in the LZ4 block format: sequences of
+// (token, literals, 2-byte offset, match length), greedy matching on a
+// hash of 4-byte prefixes. fast enough to run on every large msg, and
+// the decoder checks every length against both buffers.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5		// a block ends with at least this many literals
+#define LZ_MATCH_LIMIT 12		// no match starts this close to the end
+#define LZ_MAX_OFFSET 65535
+#define LZ_MAX_HASH_BITS 14
+
+inline uint32_t lz_read32(const char *p) {
+	uint32_t x;
+	memcpy(&x, p, 4);
+	return x;
+}
+
+// bytes src and ref have in common, up to end
+inline size_t lz_match_len(const char *src, const char *ref, const char *end) {
+	const char *p = src;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (p + 8 <= end) {
+		uint64_t a, b;
+		memcpy(&a, p, 8);
+		memcpy(&b, ref, 8);
+		if (a != b) return p - src + (__builtin_ctzll(a ^ b) >> 3);
+		p += 8;
+		ref += 8;
+	}
+#endif
+	while (p < end && *p == *ref) {
+		p++;
+		ref++;
+	}
+	return p - src;
+}
+
+// a length beyond the 4 bits of the token goes in 255-valued bytes
+inline char *lz_put_len(char *op, size_t len) {
+	for (; len >= 255; len -= 255) *op++ = (char)255;
+	*op++ = (char)len;
+	return op;
+}
+
+// compress n bytes at src into dst, return the compressed size,
+// or 0 if it does not fit in cap bytes
+inline size_t lz_compress(const char *src, size_t n, char *dst, size_t cap) {
+	// the table scales with the input, so small msgs do not pay for clearing it
+	int bits = 8;
+	while (bits < LZ_MAX_HASH_BITS && ((size_t)1 << bits) < n) bits++;
+	uint32_t table[1 << LZ_MAX_HASH_BITS];
+	memset(table, 0, sizeof(uint32_t) << bits);
+
+	const char *ip = src, *anchor = src, *end = src + n;
+	const char *limit = n > LZ_MATCH_LIMIT ? end - LZ_MATCH_LIMIT : src;
+	char *op = dst, *oend = dst + cap;
+	while (ip < limit) {
+		uint32_t seq = lz_read32(ip);
+		uint32_t h = (seq * 2654435761u) >> (32 - bits);
+		const char *ref = src + table[h];
+		table[h] = ip - src;
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+			// skip faster through data that does not match
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		size_t mlen = LZ_MIN_MATCH + lz_match_len(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH,
+				end - LZ_LAST_LITERALS);
+		size_t lit = ip - anchor;
+		if ((size_t)(oend - op) < 1 + lit + lit / 255 + 2 + mlen / 255 + 2) return 0;
+
+		// token, literals, offset, rest of the match length
+		char *token = op++;
+		size_t ml = mlen - LZ_MIN_MATCH;
+		*token = (char)(((lit < 15 ? lit : 15) << 4) | (ml < 15 ? ml : 15));
+		if (lit >= 15) op = lz_put_len(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+		size_t off = ip - ref;
+		*op++ = (char)(off & 0xff);
+		*op++ = (char)(off >> 8);
+		if (ml >= 15) op = lz_put_len(op, ml - 15);
+
+		ip += mlen;
+		anchor = ip;
+		if (ip < limit) {
+			// a position inside the match helps the next lookups
+			const char *p = ip - 2;
+			table[(lz_read32(p) * 2654435761u) >> (32 - bits)] = p - src;
+		}
+	}
+
+	// the rest goes as literals
+	size_t lit = end - anchor;
+	if ((size_t)(oend - op) < 1 + lit + lit / 255 + 1) return 0;
+	*op++ = (char)((lit < 15 ? lit : 15) << 4);
+	if (lit >= 15) op = lz_put_len(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+	return op - dst;
+}
+
+// decompress n bytes at src into exactly out bytes at dst, false on a bad block
+inline bool lz_decompress(const char *src, size_t n, char *dst, size_t out) {
+	const unsigned char *ip = (const unsigned char *)src, *iend = ip + n;
+	char *op = dst, *oend = dst + out;
+
+	// a length continued in 255-valued bytes
+	auto get_len = [&](size_t &len) {
+		unsigned char b;
+		do {
+			if (ip >= iend) return false;
+			b = *ip++;
+			len += b;
+		} while (b == 255);
+		return true;
+	};
+
+	while (ip < iend) {
+		unsigned char token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15 && !get_len(lit)) return false;
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return false;
+		if (lit <= 16 && iend - ip >= 16 && oend - op >= 16)
+			memcpy(op, ip, 16);		// a fixed size copy is inlined, the overrun is overwritten later
+		else
+			memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == iend) break;		// last literals
+
+		if (iend - ip < 2) return false;
+		size_t off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t mlen = token & 15;
+		if (mlen == 15 && !get_len(mlen)) return false;
+		mlen += LZ_MIN_MATCH;
+		if (off == 0 || off > (size_t)(op - dst) || mlen > (size_t)(oend - op)) return false;
+
+		const char *ref = op - off;
+		char *mend = op + mlen;
+		if (off < 8) {
+			// a short offset repeats the last off bytes, widen it to a multiple of off >= 8
+			size_t w = off * ((8 + off - 1) / off);
+			for (size_t i = 0; i < w && op < mend; i++) *op++ = *ref++;
+			ref = op - w;
+		}
+		if (oend - mend >= 8) {
+			// 8 bytes at a time, the overrun is overwritten later
+			for (; op < mend; op += 8, ref += 8) memcpy(op, ref, 8);
+			op = mend;
+		} else {
+			while (op < mend) *op++ = *ref++;
+		}
+	}
+	return op == oend;
+}
@@ -0,0 +1,52 @@
+#pragma once
+// lock-free multi-producer single-consumer queue.
+
+#include <atomic>
+#include <vector>
+
+template <class T>
+class mpsc_queue {
+    struct node {
+        T val;
+        node *next;
+    };
+    std::atomic<node *> head_;  // most recently pushed node
+
+public:
+    mpsc_queue(): head_(nullptr) {}
+
+    ~mpsc_queue() {
+        std::vector<T> left;
+        pop_all(left);
+    }
+
+    // safe from any thread, return true if the queue was empty so
+    // the producer knows the consumer has to be woken up
+    bool push(const T &v) {
+        node *n = new node{v, nullptr};
+        node *old = head_.load(std::memory_order_relaxed);
+        // n may be consumed as soon as it is published, don't touch it after
+        do {
+            n->next = old;
+        } while (!head_.compare_exchange_weak(old, n,
+                    std::memory_order_release, std::memory_order_relaxed));
+        return old == nullptr;
+    }
+
+    // only from the consumer, append everything queued to out in push order
+    // return the number of popped items
+    size_t pop_all(std::vector<T> &out) {
+        node *n = head_.exchange(nullptr, std::memory_order_acquire);
+        size_t base = out.size(), cnt = 0;
+        for (; n; cnt++) {
+            node *next = n->next;
+            out.push_back(n->val);
+            delete n;
+            n = next;
+        }
+        // the stack is newest first
+        for (size_t i = 0; i < cnt / 2; i++)
+            std::swap(out[base + i], out[base + cnt - 1 - i]);
+        return cnt;
+    }
+};
@@ -0,0 +1,147 @@
+#pragma once
+// hierarchical timing wheel: 4 levels of 256 slots over ticks of
+// 1 << TW_TICK_SHIFT usec, so about 76 hours at 64 usec resolution.
+// a timer goes in the level its distance falls in, and a slot of a higher
+// level is spread over the lower ones once the time reaches it, so add,
+// del and expiry are O(1). not thread safe.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils/verify.h"
+
+#define TW_TICK_SHIFT 6		// a tick is 64 usec
+#define TW_BITS 8
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 4
+
+// embed it in the obj a timer is for
+struct timer_node {
+	timer_node *prev, *next;	// NULL while not in a wheel
+	uint64_t when;				// expiry tick
+	int level;
+
+	timer_node(): prev(NULL), next(NULL), when(0), level(0) {}
+	bool pending() { return prev != NULL; }
+};
+
+class timer_wheel {
+	timer_node slots_[TW_LEVELS][TW_SLOTS];	// list heads
+	size_t cnt_[TW_LEVELS];
+	uint64_t now_;		// next tick to expire
+
+	void link(timer_node *n) {
+		uint64_t d = n->when > now_ ? n->when - now_ : 0;
+		int l = 0;
+		while (l < TW_LEVELS - 1 && d >= (uint64_t)1 << (TW_BITS * (l + 1))) l++;
+		// past the last level, wait in its furthest slot
+		uint64_t at = d >> (TW_BITS * TW_LEVELS) ? now_ + ((uint64_t)1 << (TW_BITS * TW_LEVELS)) - 1 : n->when;
+		if (d == 0) at = now_;
+		timer_node *h = &slots_[l][(at >> (TW_BITS * l)) & TW_MASK];
+		n->level = l;
+		n->prev = h->prev;
+		n->next = h;
+		h->prev->next = n;
+		h->prev = n;
+		cnt_[l]++;
+	}
+
+	void unlink(timer_node *n) {
+		n->prev->next = n->next;
+		n->next->prev = n->prev;
+		n->prev = n->next = NULL;
+		cnt_[n->level]--;
+	}
+
+	// spread slot idx of level l over the lower levels
+	void cascade(int l, int idx) {
+		timer_node *h = &slots_[l][idx];
+		while (h->next != h) {
+			timer_node *n = h->next;
+			unlink(n);
+			link(n);
+		}
+	}
+
+public:
+	timer_wheel(uint64_t now_us = 0): now_(now_us >> TW_TICK_SHIFT) {
+		for (int l = 0; l < TW_LEVELS; l++) {
+			cnt_[l] = 0;
+			for (int i = 0; i < TW_SLOTS; i++)
+				slots_[l][i].prev = slots_[l][i].next = &slots_[l][i];
+		}
+	}
+
+	timer_wheel(const timer_wheel &) = delete;
+	timer_wheel &operator=(const timer_wheel &) = delete;
+
+	static uint64_t tick_of(uint64_t us) { return (us + (1 << TW_TICK_SHIFT) - 1) >> TW_TICK_SHIFT; }
+	static uint64_t usec_of(uint64_t tick) { return tick << TW_TICK_SHIFT; }
+
+	bool empty() { return !cnt_[0] && !cnt_[1] && !cnt_[2] && !cnt_[3]; }
+
+	// expire n at usec us, never before
+	void add(timer_node *n, uint64_t us) {
+		VERIFY(!n->pending());
+		n->when = tick_of(us);
+		link(n);
+	}
+
+	void del(timer_node *n) {
+		if (n->pending()) unlink(n);
+	}
+
+	// expire every timer due by usec us, fn(n) is called once per timer,
+	// which is out of the wheel by then and may be added again
+	template <class F>
+	void advance(uint64_t us, F fn) {
+		uint64_t end = us >> TW_TICK_SHIFT;
+		while (now_ <= end) {
+			int idx = now_ & TW_MASK;
+			if (idx == 0) {
+				// a new round of level 0, and maybe of the levels above
+				for (int l = 1; l < TW_LEVELS; l++) {
+					int i = (now_ >> (TW_BITS * l)) & TW_MASK;
+					cascade(l, i);
+					if (i != 0) break;
+				}
+			}
+			if (!cnt_[0]) {
+				// nothing expires before the next round
+				uint64_t next = (now_ | TW_MASK) + 1;
+				now_ = empty() || next > end ? end + 1 : next;
+				continue;
+			}
+			timer_node *h = &slots_[0][idx];
+			while (h->next != h) {
+				timer_node *n = h->next;
+				unlink(n);
+				fn(n);
+			}
+			now_++;
+		}
+	}
+
+	// usec by which advance must be called next, a lower bound of the
+	// first expiry. UINT64_MAX if there is no timer
+	uint64_t next_usec() {
+		uint64_t first = UINT64_MAX;
+		for (int l = 0; l < TW_LEVELS; l++) {
+			if (!cnt_[l]) continue;
+			int shift = TW_BITS * l;
+			uint64_t base = now_ >> shift;
+			// level 0 starts at the current slot. a slot above is reached when
+			// the round below it ends, the current one only if that is now
+			bool cur = l == 0 || (now_ & (((uint64_t)1 << shift) - 1)) == 0;
+			for (int k = cur ? 0 : 1; k <= TW_SLOTS; k++) {
+				timer_node *h = &slots_[l][(base + k) & TW_MASK];
+				if (h->next == h) continue;
+				uint64_t t = l == 0 ? base + k : (base + k) << shift;
+				if (t < first) first = t;
+				break;
+			}
+		}
+		return first == UINT64_MAX ? first : usec_of(first);
+	}
+};